@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dirscan.h"
+#include "checkpoint.h"
+
+/* The hashes are 64-bit FNV-1a.  A FAT sector's hash is taken over the
+   widened values of the entries that start in it, rather than its raw
+   bytes, so it comes from the FAT cache and a FAT-12 entry that
+   straddles two sectors belongs to just the first. */
+
+#define FNV_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+#define FAT_CHUNK	1024	/* FAT entries hashed per read */
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *p, size_t n)
+{
+    while (n-- > 0)
+    {
+	h ^= *p++;
+	h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static uint32_t fat_sector(const struct dosgeom *geom, uint32_t cluster)
+{
+    return (uint64_t)cluster * geom->fattype / 8 / geom->bytes_per_sec;
+}
+
+static uint32_t count_fat_sectors(const struct dosgeom *geom)
+{
+    return fat_sector(geom, geom->max_cluster - 1) + 1;
+}
+
+/* hash_fat fills in one hash per FAT sector */
+static void hash_fat(struct dosimage *img, uint64_t *fathash)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    uint32_t i, n = count_fat_sectors(geom), c, k, count;
+    uint32_t vals[FAT_CHUNK];
+    uint8_t bytes[4];
+
+    for (i = 0; i < n; i++)
+	fathash[i] = FNV_BASIS;
+    for (c = CLUST_FIRST; c < geom->max_cluster; c += count)
+    {
+	count = geom->max_cluster - c;
+	if (count > FAT_CHUNK)
+	    count = FAT_CHUNK;
+	get_fat_entries(img, c, count, vals);
+	for (k = 0; k < count; k++)
+	{
+	    putulong(bytes, vals[k]);
+	    i = fat_sector(geom, c + k);
+	    fathash[i] = hash_bytes(fathash[i], bytes, 4);
+	}
+    }
+}
+
+static void add_dir(struct checkpoint *cp, uint32_t *maxdirs,
+		    uint32_t cluster, const void *data, size_t n)
+{
+    if (cp->ndirs == *maxdirs)
+    {
+	*maxdirs = *maxdirs ? 2 * *maxdirs : 64;
+	cp->dirs = realloc(cp->dirs, *maxdirs * sizeof(struct dirhash));
+    }
+    cp->dirs[cp->ndirs].cluster = cluster;
+    cp->dirs[cp->ndirs].hash = hash_bytes(FNV_BASIS, data, n);
+    cp->ndirs++;
+}
+
+struct checkpoint *checkpoint_take(struct dosimage *img, struct dirscan *ds)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    struct checkpoint *cp;
+    struct direntry *dirent;
+    uint32_t c, maxdirs = 0;
+
+    cp = calloc(1, sizeof(struct checkpoint));
+    cp->fattype = geom->fattype;
+    cp->total_secs = geom->total_secs;
+    cp->clust_size = geom->clust_size;
+    cp->nfatsecs = count_fat_sectors(geom);
+    cp->fathash = malloc(cp->nfatsecs * sizeof(uint64_t));
+    hash_fat(img, cp->fathash);
+
+    /* the scan's copy of each cluster is one run of entries */
+    if (geom->fattype != 32 && (dirent = dirscan_entry(ds, MSDOSFSROOT, 0)) != NULL)
+	add_dir(cp, &maxdirs, MSDOSFSROOT, dirent,
+		geom->root_ents * sizeof(struct direntry));
+    for (c = CLUST_FIRST; c < geom->max_cluster; c++)
+    {
+	if ((dirent = dirscan_entry(ds, c, 0)) != NULL)
+	    add_dir(cp, &maxdirs, c, dirent, geom->clust_size);
+    }
+    return cp;
+}
+
+void checkpoint_free(struct checkpoint *cp)
+{
+    free(cp->fathash);
+    free(cp->dirs);
+    free(cp);
+}
+
+void checkpoint_save(struct checkpoint *cp, FILE *f)
+{
+    uint32_t i;
+
+    fprintf(f, "checkpoint fat%d %u %u\n", cp->fattype, cp->total_secs,
+	    cp->clust_size);
+    for (i = 0; i < cp->nfatsecs; i++)
+	fprintf(f, "fat %u %016llx\n", i, (unsigned long long)cp->fathash[i]);
+    for (i = 0; i < cp->ndirs; i++)
+	fprintf(f, "dir %u %016llx\n", cp->dirs[i].cluster,
+		(unsigned long long)cp->dirs[i].hash);
+}
+
+struct checkpoint *checkpoint_load(FILE *f)
+{
+    struct checkpoint *cp;
+    char line[128];
+    unsigned long long hash;
+    uint32_t n, maxfat = 0, maxdirs = 0;
+    int lineno = 1;
+
+    cp = calloc(1, sizeof(struct checkpoint));
+    if (fgets(line, sizeof(line), f) == NULL
+	|| sscanf(line, "checkpoint fat%d %u %u", &cp->fattype, &cp->total_secs,
+		  &cp->clust_size) != 3)
+    {
+	fprintf(stderr, "checkpoint: not a checkpoint\n");
+	checkpoint_free(cp);
+	return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+	lineno++;
+	/* FAT sectors come in order, then directories in cluster order */
+	if (sscanf(line, "fat %u %llx", &n, &hash) == 2
+	    && n == cp->nfatsecs && cp->ndirs == 0)
+	{
+	    if (cp->nfatsecs == maxfat)
+	    {
+		maxfat = maxfat ? 2 * maxfat : 64;
+		cp->fathash = realloc(cp->fathash, maxfat * sizeof(uint64_t));
+	    }
+	    cp->fathash[cp->nfatsecs++] = hash;
+	    continue;
+	}
+	if (sscanf(line, "dir %u %llx", &n, &hash) == 2
+	    && (cp->ndirs == 0 || n > cp->dirs[cp->ndirs-1].cluster))
+	{
+	    if (cp->ndirs == maxdirs)
+	    {
+		maxdirs = maxdirs ? 2 * maxdirs : 64;
+		cp->dirs = realloc(cp->dirs, maxdirs * sizeof(struct dirhash));
+	    }
+	    cp->dirs[cp->ndirs].cluster = n;
+	    cp->dirs[cp->ndirs].hash = hash;
+	    cp->ndirs++;
+	    continue;
+	}
+	fprintf(stderr, "checkpoint: can't read line %d\n", lineno);
+	checkpoint_free(cp);
+	return NULL;
+    }
+    return cp;
+}
+
+int checkpoint_fits(struct checkpoint *cp, struct dosimage *img)
+{
+    const struct dosgeom *geom = get_geometry(img);
+
+    return cp->fattype == geom->fattype && cp->total_secs == geom->total_secs
+	&& cp->clust_size == geom->clust_size
+	&& cp->nfatsecs == count_fat_sectors(geom);
+}
+
+int checkpoint_unchanged(struct checkpoint *cp, struct dosimage *img)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    uint64_t *fathash;
+    uint8_t *buf, *data;
+    uint32_t i, c;
+    size_t n;
+    int same;
+
+    if (!checkpoint_fits(cp, img))
+	return FALSE;
+
+    fathash = malloc(cp->nfatsecs * sizeof(uint64_t));
+    hash_fat(img, fathash);
+    same = memcmp(fathash, cp->fathash, cp->nfatsecs * sizeof(uint64_t)) == 0;
+    free(fathash);
+
+    buf = malloc(geom->clust_size);
+    for (i = 0; same && i < cp->ndirs; i++)
+    {
+	c = cp->dirs[i].cluster;
+	if (c == MSDOSFSROOT && geom->fattype != 32)
+	{
+	    data = root_dir_addr(img);
+	    n = geom->root_ents * sizeof(struct direntry);
+	}
+	else if (c >= CLUST_FIRST && c < geom->max_cluster)
+	{
+	    data = read_clusters(img, c, 1, buf);
+	    n = geom->clust_size;
+	}
+	else
+	{
+	    same = FALSE;
+	    break;
+	}
+	same = hash_bytes(FNV_BASIS, data, n) == cp->dirs[i].hash;
+    }
+    free(buf);
+    return same;
+}
+
+uint32_t checkpoint_fat_changes(struct checkpoint *last, struct checkpoint *now,
+				struct dosimage *img, uint64_t *dirty)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    uint8_t *differs;
+    uint32_t i, c, changed = 0;
+
+    differs = calloc(now->nfatsecs, 1);
+    for (i = 0; i < now->nfatsecs; i++)
+    {
+	if (i >= last->nfatsecs || last->fathash[i] != now->fathash[i])
+	{
+	    differs[i] = 1;
+	    changed++;
+	}
+    }
+    for (c = CLUST_FIRST; changed > 0 && c < geom->max_cluster; c++)
+    {
+	if (differs[fat_sector(geom, c)])
+	    dirty[c / 64] |= (uint64_t)1 << (c % 64);
+    }
+    free(differs);
+    return changed;
+}
+
+static struct dirhash *find_dir(struct checkpoint *cp, uint32_t cluster)
+{
+    uint32_t lo = 0, hi = cp->ndirs, mid;
+
+    while (lo < hi)
+    {
+	mid = lo + (hi - lo) / 2;
+	if (cp->dirs[mid].cluster == cluster)
+	    return &cp->dirs[mid];
+	if (cp->dirs[mid].cluster < cluster)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return NULL;
+}
+
+int checkpoint_dir_changed(struct checkpoint *last, struct checkpoint *now,
+			   uint32_t cluster)
+{
+    struct dirhash *was = find_dir(last, cluster), *is = find_dir(now, cluster);
+
+    return was == NULL || is == NULL || was->hash != is->hash;
+}
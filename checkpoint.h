@@ -0,0 +1,66 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* A checkpoint records what an image looked like when a check found
+   nothing wrong with it: a hash of the FAT entries in each FAT sector,
+   and a hash of every directory cluster the check read.  Checking the
+   same image again, anything whose hash still matches is known to be
+   as good as it was then.
+
+   The directories a check reads are decided by the FAT and by the
+   directories themselves, so if none of those hashes has changed the
+   image still passes, and only the clusters in the checkpoint need
+   reading to show it. */
+
+struct dosimage;
+struct dirscan;
+
+struct dirhash {
+    uint32_t cluster;		/* 0 for the fixed root directory */
+    uint64_t hash;
+};
+
+struct checkpoint {
+    int fattype;		/* what the checkpoint was taken of */
+    uint32_t total_secs;
+    uint32_t clust_size;
+    uint32_t nfatsecs;
+    uint64_t *fathash;		/* one per FAT sector */
+    uint32_t ndirs;
+    struct dirhash *dirs;	/* in cluster order */
+};
+
+/* checkpoint_take hashes the image's FAT and the directory clusters
+   in a scan, which must not have been edited yet */
+struct checkpoint *checkpoint_take(struct dosimage *, struct dirscan *);
+void checkpoint_free(struct checkpoint *);
+
+/* checkpoint_save writes the checkpoint as text; checkpoint_load reads
+   it back, returning NULL if it can't */
+void checkpoint_save(struct checkpoint *, FILE *);
+struct checkpoint *checkpoint_load(FILE *);
+
+/* checkpoint_fits returns true if the checkpoint was taken of a volume
+   with this geometry */
+int checkpoint_fits(struct checkpoint *, struct dosimage *);
+
+/* checkpoint_unchanged hashes the FAT and the directory clusters named
+   in the checkpoint straight from the image, and returns true if every
+   one of them still matches */
+int checkpoint_unchanged(struct checkpoint *, struct dosimage *);
+
+/* checkpoint_fat_changes returns how many FAT sectors differ between
+   two checkpoints of the image, and sets the bit in dirty of every
+   cluster whose FAT entry is in one of them */
+uint32_t checkpoint_fat_changes(struct checkpoint *last, struct checkpoint *now,
+				struct dosimage *, uint64_t *dirty);
+
+/* checkpoint_dir_changed returns true unless the directory cluster is
+   in both checkpoints with the same hash */
+int checkpoint_dir_changed(struct checkpoint *last, struct checkpoint *now,
+			   uint32_t cluster);
+
+#endif // __CHECKPOINT_H__
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dirscan.h"
+
+/* The scan hands out directories, not whole subtrees.  Each thread
+   has its own queue of directory start clusters; it pushes the
+   subdirectories it finds onto the back of its own queue and takes
+   work from there, and a thread with nothing left takes the oldest
+   entry off the front of someone else's.  The oldest entries are the
+   ones nearest the root, so a steal usually moves a large piece of the
+   tree.
+
+   Everything a thread finds goes into buffers only it touches, and
+   they are merged once all the threads have stopped.  The only shared
+   state while the scan runs is the queues, a count of directories
+   still to do, and a bitmap of the directory clusters already claimed,
+   which is what stops two threads copying the same cluster and stops
+   a directory loop from going round forever.
+
+   The threads only call read_clusters and get_fat_entry.  On the
+   pread backend read_clusters looks each cluster up in the shared
+   sector cache, so that a cached copy wins; that is safe only because
+   nothing inserts into or evicts from the cache while the scan runs.
+   So the threads must never call cluster_to_addr or anything else that
+   goes through the cache's block call.  The fixed root directory is
+   fetched through it before they start. */
+
+#define DIRSCAN_MAX_THREADS 64
+
+struct workqueue {
+    pthread_mutex_t lock;
+    uint32_t *items;		/* ring of directory start clusters */
+    uint32_t head;		/* oldest item */
+    uint32_t count;
+    uint32_t size;
+};
+
+/* one copied directory cluster */
+struct dircopy {
+    uint32_t cluster;		/* MSDOSFSROOT for the fixed root */
+    uint32_t first;		/* index of its first entry in ents */
+};
+
+struct worker {
+    struct dirscan *ds;
+    int id;
+    pthread_t thread;
+    struct workqueue q;
+    uint8_t *buf;		/* one cluster, for read_clusters */
+
+    /* what this thread found */
+    struct dircopy *dirs;
+    uint32_t ndirs, maxdirs;
+    struct direntry *ents;
+    uint32_t nents, maxents;
+};
+
+struct dirscan {
+    struct dosimage *img;
+    const struct dosgeom *geom;
+    uint32_t perclust;		/* entries in a directory cluster */
+    uint8_t *root;		/* the fixed root directory, or NULL */
+    uint64_t *claimed;		/* one bit per cluster */
+    uint32_t pending;		/* directories queued or being scanned */
+    int nworkers;
+    struct worker *workers;
+
+    /* the merged results */
+    struct direntry *ents;
+    uint32_t nents;
+    uint32_t *at;		/* 1 + index in ents of each cluster's
+				   first entry; 0 if it wasn't scanned */
+    uint32_t rootat;
+};
+
+
+static void queue_init(struct workqueue *q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    q->size = 64;
+    q->items = malloc(q->size * sizeof(uint32_t));
+    q->head = 0;
+    q->count = 0;
+}
+
+static void queue_destroy(struct workqueue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+static void queue_push(struct workqueue *q, uint32_t cluster)
+{
+    uint32_t *items, i;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->size)
+    {
+	items = malloc(2 * q->size * sizeof(uint32_t));
+	for (i = 0; i < q->count; i++)
+	    items[i] = q->items[(q->head + i) % q->size];
+	free(q->items);
+	q->items = items;
+	q->head = 0;
+	q->size *= 2;
+    }
+    q->items[(q->head + q->count) % q->size] = cluster;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* queue_take removes the newest item, or the oldest if steal is set */
+static int queue_take(struct workqueue *q, uint32_t *cluster, int steal)
+{
+    int found = FALSE;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0)
+    {
+	if (steal)
+	{
+	    *cluster = q->items[q->head];
+	    q->head = (q->head + 1) % q->size;
+	}
+	else
+	{
+	    *cluster = q->items[(q->head + q->count - 1) % q->size];
+	}
+	q->count--;
+	found = TRUE;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+
+/* claim returns true if this thread is the first to want cluster */
+static int claim(struct dirscan *ds, uint32_t cluster)
+{
+    uint64_t bit = (uint64_t)1 << (cluster % 64);
+
+    return (__atomic_fetch_or(&ds->claimed[cluster / 64], bit,
+			      __ATOMIC_RELAXED) & bit) == 0;
+}
+
+static void queue_dir(struct worker *w, uint32_t cluster)
+{
+    /* counted before it's visible, so pending can't hit zero while
+       the directory waits in the queue */
+    __atomic_add_fetch(&w->ds->pending, 1, __ATOMIC_ACQ_REL);
+    queue_push(&w->q, cluster);
+}
+
+/* copy_entries keeps a copy of n directory entries and queues the
+   subdirectories among them.  Entries are picked the way scandisk's walk picks
+   them, so hidden directories are skipped too. */
+static void copy_entries(struct worker *w, uint32_t cluster,
+			 const uint8_t *data, uint32_t n)
+{
+    struct dosimage *img = w->ds->img;
+    struct direntry *dirent;
+    uint32_t i, start;
+    uint8_t attr;
+
+    if (w->ndirs == w->maxdirs)
+    {
+	w->maxdirs = w->maxdirs ? 2 * w->maxdirs : 16;
+	w->dirs = realloc(w->dirs, w->maxdirs * sizeof(struct dircopy));
+    }
+    w->dirs[w->ndirs].cluster = cluster;
+    w->dirs[w->ndirs].first = w->nents;
+    w->ndirs++;
+
+    while (w->nents + n > w->maxents)
+    {
+	w->maxents = w->maxents ? 2 * w->maxents : 256;
+	w->ents = realloc(w->ents, w->maxents * sizeof(struct direntry));
+    }
+    memcpy(w->ents + w->nents, data, n * sizeof(struct direntry));
+
+    for (i = 0; i < n; i++)
+    {
+	dirent = &w->ents[w->nents + i];
+	attr = dirent->deAttributes;
+	if (dirent->deName[0] == SLOT_EMPTY
+	    || dirent->deName[0] == SLOT_DELETED
+	    || dirent->deName[0] == '.'
+	    || (attr & ATTR_WIN95LFN) == ATTR_WIN95LFN
+	    || (attr & ATTR_VOLUME) != 0
+	    || (attr & (ATTR_DIRECTORY|ATTR_HIDDEN)) != ATTR_DIRECTORY)
+	    continue;
+
+	start = dirent_cluster(img, dirent);
+	if (is_valid_cluster(img, start))
+	    queue_dir(w, start);
+    }
+    w->nents += n;
+}
+
+/* scan_dir copies every cluster of a directory that no other thread
+   has got to first */
+static void scan_dir(struct worker *w, uint32_t cluster)
+{
+    struct dirscan *ds = w->ds;
+
+    if (cluster == MSDOSFSROOT)
+    {
+	copy_entries(w, cluster, ds->root, ds->geom->root_ents);
+	return;
+    }
+    while (is_valid_cluster(ds->img, cluster) && claim(ds, cluster))
+    {
+	copy_entries(w, cluster, read_clusters(ds->img, cluster, 1, w->buf),
+		     ds->perclust);
+	cluster = get_fat_entry(ds->img, cluster);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct dirscan *ds = w->ds;
+    uint32_t cluster;
+    int i, found;
+
+    for (;;)
+    {
+	found = queue_take(&w->q, &cluster, FALSE);
+	for (i = 1; !found && i < ds->nworkers; i++)
+	    found = queue_take(&ds->workers[(w->id + i) % ds->nworkers].q,
+			       &cluster, TRUE);
+	if (found)
+	{
+	    scan_dir(w, cluster);
+	    __atomic_sub_fetch(&ds->pending, 1, __ATOMIC_ACQ_REL);
+	}
+	else if (__atomic_load_n(&ds->pending, __ATOMIC_ACQUIRE) == 0)
+	{
+	    break;
+	}
+	else
+	{
+	    sched_yield();
+	}
+    }
+    return NULL;
+}
+
+/* merge moves every thread's results into one table */
+static void merge(struct dirscan *ds)
+{
+    struct worker *w;
+    uint32_t i, total = 0;
+    int t;
+
+    for (t = 0; t < ds->nworkers; t++)
+	total += ds->workers[t].nents;
+    ds->ents = malloc((total ? total : 1) * sizeof(struct direntry));
+    ds->at = calloc(ds->geom->max_cluster, sizeof(uint32_t));
+    ds->rootat = 0;
+    ds->nents = 0;
+
+    for (t = 0; t < ds->nworkers; t++)
+    {
+	w = &ds->workers[t];
+	memcpy(ds->ents + ds->nents, w->ents, w->nents * sizeof(struct direntry));
+	for (i = 0; i < w->ndirs; i++)
+	{
+	    if (w->dirs[i].cluster == MSDOSFSROOT)
+		ds->rootat = ds->nents + w->dirs[i].first + 1;
+	    else
+		ds->at[w->dirs[i].cluster] = ds->nents + w->dirs[i].first + 1;
+	}
+	ds->nents += w->nents;
+    }
+}
+
+struct dirscan *dirscan_run(struct dosimage *img, int nthreads)
+{
+    struct dirscan *ds;
+    struct worker *w;
+    int t;
+
+    if (nthreads <= 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+	nthreads = 1;
+    if (nthreads > DIRSCAN_MAX_THREADS)
+	nthreads = DIRSCAN_MAX_THREADS;
+
+    ds = calloc(1, sizeof(struct dirscan));
+    ds->img = img;
+    ds->geom = get_geometry(img);
+    ds->perclust = ds->geom->clust_size / sizeof(struct direntry);
+    ds->claimed = calloc((ds->geom->max_cluster + 63) / 64, sizeof(uint64_t));
+    ds->nworkers = nthreads;
+    ds->workers = calloc(nthreads, sizeof(struct worker));
+    for (t = 0; t < nthreads; t++)
+    {
+	w = &ds->workers[t];
+	w->ds = ds;
+	w->id = t;
+	queue_init(&w->q);
+	w->buf = malloc(ds->geom->clust_size);
+    }
+
+    if (ds->geom->fattype == 32)
+    {
+	queue_dir(&ds->workers[0], ds->geom->root_cluster);
+    }
+    else
+    {
+	ds->root = root_dir_addr(img);
+	queue_dir(&ds->workers[0], MSDOSFSROOT);
+    }
+
+    /* the calling thread is worker 0 */
+    for (t = 1; t < nthreads; t++)
+    {
+	if (pthread_create(&ds->workers[t].thread, NULL, worker_main,
+			   &ds->workers[t]) != 0)
+	{
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+    worker_main(&ds->workers[0]);
+    for (t = 1; t < nthreads; t++)
+	pthread_join(ds->workers[t].thread, NULL);
+
+    merge(ds);
+    for (t = 0; t < nthreads; t++)
+    {
+	w = &ds->workers[t];
+	queue_destroy(&w->q);
+	free(w->buf);
+	free(w->dirs);
+	free(w->ents);
+    }
+    free(ds->workers);
+    ds->workers = NULL;
+    free(ds->claimed);
+    ds->claimed = NULL;
+    ds->root = NULL;
+    return ds;
+}
+
+void dirscan_free(struct dirscan *ds)
+{
+    free(ds->ents);
+    free(ds->at);
+    free(ds);
+}
+
+/* index_of returns 1 + the index in ents of an entry, or 0 */
+static uint32_t index_of(struct dirscan *ds, uint32_t cluster, uint32_t slot)
+{
+    if (cluster == MSDOSFSROOT && ds->geom->fattype == 32)
+	cluster = ds->geom->root_cluster;
+    if (cluster == MSDOSFSROOT)
+	return ds->rootat && slot < ds->geom->root_ents ? ds->rootat + slot : 0;
+    if (cluster >= ds->geom->max_cluster || ds->at[cluster] == 0
+	|| slot >= ds->perclust)
+	return 0;
+    return ds->at[cluster] + slot;
+}
+
+struct direntry *dirscan_entry(struct dirscan *ds, uint32_t cluster, uint32_t slot)
+{
+    uint32_t i = index_of(ds, cluster, slot);
+    return i ? &ds->ents[i - 1] : NULL;
+}
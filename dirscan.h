@@ -0,0 +1,26 @@
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+#include <stdint.h>
+
+/* dirscan reads every directory of an image once, on a pool of
+   threads, and keeps a copy of each directory cluster it reached.  It
+   only reads the image; the copies are the caller's to edit and write
+   back. */
+
+struct dirscan;
+struct direntry;
+struct dosimage;
+
+/* dirscan_run scans the image with nthreads threads, or one per online
+   CPU if nthreads is 0.  The image must not be touched from anywhere
+   else until it returns. */
+struct dirscan *dirscan_run(struct dosimage *, int nthreads);
+void dirscan_free(struct dirscan *);
+
+/* dirscan_entry returns the copy of the entry at slot in a directory
+   cluster (0 is the fixed root directory), or NULL if the scan never
+   reached that cluster */
+struct direntry *dirscan_entry(struct dirscan *, uint32_t cluster, uint32_t slot);
+
+#endif // __DIRSCAN_H__
@@ -7,6 +7,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -15,14 +19,348 @@
 #include "dos.h"
 
 
-static int imagesize = 0;
+/* the FAT cache is part of the image, but it's defined further down
+   with the rest of the FAT code */
+struct fatcache;
+static struct fatcache *fat_cache_load(struct dosimage *);
+static void fat_cache_flush(struct fatcache *);
+static void fat_cache_free(struct fatcache *);
+
+struct imageops;
+struct sectorcache;
+
+struct dosimage {
+    int fd;
+    int flags;			/* IMAGE_* flags it was opened with */
+    const struct imageops *ops;	/* how bytes get in and out of the file */
+    uint8_t *buf;		/* the mapped image (mmap backend only) */
+    uint64_t size;
+    struct sectorcache *cache;	/* recently used blocks (pread backend only) */
+    struct bpb33 bpb;		/* word-aligned copy of the boot sector BPB */
+    struct dosgeom geom;
+    struct fatcache *fatc;
+};
+
+/* An image backend moves bytes between the image file and memory.
+   block() returns a pointer to one piece of metadata - the fixed root
+   directory or a single cluster - that callers read, and change in
+   place if they asked for it to write.  read() and write() move bulk
+   file data; read() may hand back a pointer to the bytes instead of
+   copying them into buf. */
+struct imageops {
+    const char *name;
+    int (*open)(struct dosimage *);
+    void (*close)(struct dosimage *);
+    uint8_t *(*block)(struct dosimage *, uint64_t, uint32_t, int);
+    uint8_t *(*read)(struct dosimage *, uint64_t, uint64_t, uint8_t *);
+    void (*write)(struct dosimage *, uint64_t, uint64_t, const uint8_t *);
+};
+
+
+/* The mmap backend maps the whole image.  With IMAGE_RDONLY the file
+   is mapped private, so it works on read-only snapshots and nothing
+   is synced back on close; adding IMAGE_POPULATE prefaults the whole
+   mapping up front. */
+static int mmap_open(struct dosimage *img)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int mapflags = MAP_SHARED;
+
+    if ((uint64_t)(size_t)img->size != img->size)
+	return FALSE;
+    if (img->flags & IMAGE_RDONLY)
+    {
+	prot = PROT_READ;
+	mapflags = MAP_PRIVATE;
+    }
+#ifdef MAP_POPULATE
+    if (img->flags & IMAGE_POPULATE)
+    {
+	mapflags |= MAP_POPULATE;
+    }
+#endif
+
+    img->buf = mmap(NULL, img->size, prot, mapflags, img->fd, 0);
+    if (img->buf == MAP_FAILED) 
+    {
+	img->buf = NULL;
+	return FALSE;
+    }
+    return TRUE;
+}
+
+static void mmap_close(struct dosimage *img)
+{
+    /* a read-only mapping has nothing to write back */
+    if ((img->flags & IMAGE_RDONLY) == 0)
+    {
+	msync(img->buf, img->size, MS_SYNC);
+    }
+    munmap(img->buf, img->size);
+}
+
+static uint8_t *mmap_block(struct dosimage *img, uint64_t off, uint32_t len,
+			   int write)
+{
+    return img->buf + off;
+}
+
+static uint8_t *mmap_read(struct dosimage *img, uint64_t off, uint64_t len,
+			  uint8_t *buf)
+{
+    return img->buf + off;
+}
+
+static void mmap_write(struct dosimage *img, uint64_t off, uint64_t len,
+		       const uint8_t *buf)
+{
+    memcpy(img->buf + off, buf, len);
+}
+
+static const struct imageops mmap_ops = {
+    "mmap", mmap_open, mmap_close, mmap_block, mmap_read, mmap_write
+};
+
+
+/* The pread backend is for images that are better not mapped: block
+   devices, network filesystems where page faults are slow, and images
+   too big for the address space.  Bulk data goes straight through
+   pread/pwrite.  Metadata blocks are kept in a sector cache bounded
+   to SECTOR_CACHE_BYTES (settable at build time) and evicted least
+   recently used first.  A block fetched for writing is marked dirty,
+   and goes back to the file when it is evicted or the image is
+   closed; blocks that were only read are just dropped. */
+
+#ifndef SECTOR_CACHE_BYTES
+#define SECTOR_CACHE_BYTES (4 << 20)
+#endif
+#define SECTOR_CACHE_BUCKETS 4096
+
+struct cachedblock {
+    uint64_t off;
+    uint32_t len;
+    int dirty;
+    uint8_t *data;
+    struct cachedblock *prev, *next;	/* LRU list, newest first */
+    struct cachedblock *hnext;		/* hash chain */
+};
+
+struct sectorcache {
+    uint64_t bytes;			/* data held, in bytes */
+    struct cachedblock *newest, *oldest;
+    struct cachedblock *hash[SECTOR_CACHE_BUCKETS];
+};
+
+static void pread_full(struct dosimage *img, uint64_t off, uint64_t len,
+		       uint8_t *buf)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = pread(img->fd, buf, len, off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	{
+	    fprintf(stderr, "Cannot read disk image: %s\n", strerror(errno));
+	    exit(1);
+	}
+	if (n == 0)
+	{
+	    /* reading past the end of a short image gives zeroes, like
+	       the tail of a mapping would */
+	    memset(buf, 0, len);
+	    return;
+	}
+	buf += n;
+	off += n;
+	len -= n;
+    }
+}
+
+static void pwrite_full(struct dosimage *img, uint64_t off, uint64_t len,
+			const uint8_t *buf)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = pwrite(img->fd, buf, len, off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	{
+	    fprintf(stderr, "Cannot write disk image: %s\n", strerror(errno));
+	    exit(1);
+	}
+	buf += n;
+	off += n;
+	len -= n;
+    }
+}
+
+static inline uint32_t cache_bucket(uint64_t off)
+{
+    return (uint32_t)((off >> 9) * 0x9e3779b97f4a7c15ULL >> 52)
+	% SECTOR_CACHE_BUCKETS;
+}
+
+static struct cachedblock *cache_lookup(struct sectorcache *sc, uint64_t off)
+{
+    struct cachedblock *b;
+
+    for (b = sc->hash[cache_bucket(off)]; b != NULL; b = b->hnext)
+	if (b->off == off)
+	    return b;
+    return NULL;
+}
+
+static void cache_unlink(struct sectorcache *sc, struct cachedblock *b)
+{
+    if (b->prev != NULL)
+	b->prev->next = b->next;
+    else
+	sc->newest = b->next;
+    if (b->next != NULL)
+	b->next->prev = b->prev;
+    else
+	sc->oldest = b->prev;
+}
+
+static void cache_push(struct sectorcache *sc, struct cachedblock *b)
+{
+    b->prev = NULL;
+    b->next = sc->newest;
+    if (sc->newest != NULL)
+	sc->newest->prev = b;
+    else
+	sc->oldest = b;
+    sc->newest = b;
+}
+
+/* cache_evict writes a block back if it needs it and drops it */
+static void cache_evict(struct dosimage *img, struct cachedblock *b)
+{
+    struct sectorcache *sc = img->cache;
+    struct cachedblock **pp;
+
+    if (b->dirty)
+	pwrite_full(img, b->off, b->len, b->data);
+    cache_unlink(sc, b);
+    for (pp = &sc->hash[cache_bucket(b->off)]; *pp != b; pp = &(*pp)->hnext)
+	;
+    *pp = b->hnext;
+    sc->bytes -= b->len;
+    free(b->data);
+    free(b);
+}
 
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
+static int pread_open(struct dosimage *img)
+{
+    img->buf = NULL;
+    img->cache = calloc(1, sizeof(struct sectorcache));
+    return TRUE;
+}
+
+static void pread_close(struct dosimage *img)
+{
+    struct sectorcache *sc = img->cache;
+
+    while (sc->oldest != NULL)
+	cache_evict(img, sc->oldest);
+    if ((img->flags & IMAGE_RDONLY) == 0)
+	fsync(img->fd);
+    free(sc);
+}
+
+/* a pointer from pread_block stays good until enough other blocks
+   have been fetched to push it out of the cache */
+static uint8_t *pread_block(struct dosimage *img, uint64_t off, uint32_t len,
+			    int write)
+{
+    struct sectorcache *sc = img->cache;
+    struct cachedblock *b;
+
+    b = cache_lookup(sc, off);
+    if (b != NULL)
+    {
+	cache_unlink(sc, b);
+    }
+    else
+    {
+	b = malloc(sizeof(struct cachedblock));
+	b->off = off;
+	b->len = len;
+	b->dirty = FALSE;
+	b->data = malloc(len);
+	pread_full(img, off, len, b->data);
+	b->hnext = sc->hash[cache_bucket(off)];
+	sc->hash[cache_bucket(off)] = b;
+	sc->bytes += len;
+    }
+    cache_push(sc, b);
+    if (write && (img->flags & IMAGE_RDONLY) == 0)
+	b->dirty = TRUE;
+
+    while (sc->bytes > SECTOR_CACHE_BYTES && sc->oldest != b)
+	cache_evict(img, sc->oldest);
+    return b->data;
+}
+
+/* Bulk transfers are cluster aligned, and any of those clusters that
+   are also in the cache (a directory read as file data, say) have to
+   agree with it.  The cached copy wins on reads, and is updated on
+   writes. */
+static uint8_t *pread_read(struct dosimage *img, uint64_t off, uint64_t len,
+			   uint8_t *buf)
+{
+    struct cachedblock *b;
+    uint64_t o;
+
+    pread_full(img, off, len, buf);
+    if (img->cache->bytes == 0 || img->geom.clust_size == 0)
+	return buf;
+    for (o = off; o < off + len; o += img->geom.clust_size)
+    {
+	b = cache_lookup(img->cache, o);
+	if (b != NULL && b->off + b->len <= off + len)
+	    memcpy(buf + (o - off), b->data, b->len);
+    }
+    return buf;
+}
+
+static void pread_write(struct dosimage *img, uint64_t off, uint64_t len,
+			const uint8_t *buf)
+{
+    struct cachedblock *b;
+    uint64_t o;
+
+    pwrite_full(img, off, len, buf);
+    if (img->cache->bytes == 0 || img->geom.clust_size == 0)
+	return;
+    for (o = off; o < off + len; o += img->geom.clust_size)
+    {
+	b = cache_lookup(img->cache, o);
+	if (b != NULL && b->off + b->len <= off + len)
+	    memcpy(b->data, buf + (o - off), b->len);
+    }
+}
+
+static const struct imageops pread_ops = {
+    "pread", pread_open, pread_close, pread_block, pread_read, pread_write
+};
+
+
+/* open the disk image file and set up its backend.  IMAGE_PREAD, or
+   an image that is a block device or won't map, gets the pread
+   backend; anything else is mapped.  Returns FALSE, having said why,
+   if the image can't be opened. */
+static int open_file(struct dosimage *img, char *filename)
 {
     struct stat statbuf;
-    uint8_t *image_buf;
     char pathname[MAXPATHLEN+1];
+    off_t end;
 
 
     /* If filename isn't an absolute pathname, then we'd better prepend
@@ -31,6 +369,7 @@ uint8_t *mmap_file(char *filename, int *fd)
     if (filename[0] == '/') 
     {
 	strncpy(pathname, filename, MAXPATHLEN);
+	pathname[MAXPATHLEN] = '\0';
     } 
     else 
     {
@@ -38,70 +377,117 @@ uint8_t *mmap_file(char *filename, int *fd)
 	if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) 
 	{
 	    fprintf(stderr, "Filename too long\n");
-	    exit(1);
+	    return FALSE;
 	}
 	strcat(pathname, "/");
 	strcat(pathname, filename);
     }
 
 
-    /* Step 2: find out how big the disk image file is */
-    /* we can use "stat" to do this, by checking the file status */
+    /* Step 2: open the file for read/write, or just for reading */
 
-    if (stat(pathname, &statbuf) < 0) 
+    img->fd = open(pathname, (img->flags & IMAGE_RDONLY) ? O_RDONLY : O_RDWR);
+    if (img->fd < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	return FALSE;
     }
-    imagesize = statbuf.st_size;
 
 
-    /* Step 3: open the file for read/write */
+    /* Step 3: find out how big the disk image is.  stat gives the
+       size of a file, but a block device has to be asked */
 
-    *fd = open(pathname, O_RDWR);
-    if (*fd < 0) 
+    if (fstat(img->fd, &statbuf) < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	close(img->fd);
+	return FALSE;
+    }
+    img->size = statbuf.st_size;
+    if (S_ISBLK(statbuf.st_mode))
+    {
+	end = lseek(img->fd, 0, SEEK_END);
+	img->size = end < 0 ? 0 : end;
+	img->flags |= IMAGE_PREAD;
     }
 
 
-    /* Step 4: we memory map the file */
+    /* Step 4: map it, unless it's better read a sector at a time */
 
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
-    if (image_buf == MAP_FAILED) 
+    img->ops = &pread_ops;
+    img->cache = NULL;
+    if ((img->flags & IMAGE_PREAD) == 0)
     {
-	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
-	exit(1);
+	if (mmap_ops.open(img))
+	{
+	    img->ops = &mmap_ops;
+	    return TRUE;
+	}
+#ifdef DEBUG
+	fprintf(stderr, "Failed to memory map, using pread: %s\n", 
+		strerror(errno));
+#endif
     }
-    return image_buf;
+    img->ops->open(img);
+    return TRUE;
 }
 
 
-void unmmap_file(uint8_t *image, int *fd)
+static void close_file(struct dosimage *img)
 {
-    msync(image, imagesize, MS_SYNC);
-    munmap(image, imagesize);
-    close(*fd);
+    img->ops->close(img);
+    close(img->fd);
 }
 
 
-/* read the bootsector from the disk, and check that it is sane */
+/* advise_metadata tells the kernel the FATs and the root directory
+   are about to be read, and that the FAT is read front to back.  The
+   hints are only hints, so failures are ignored; they only mean
+   anything for a mapped image. */
+static void advise_metadata(struct dosimage *img)
+{
+    const struct dosgeom *geom = &img->geom;
+    uint8_t *image_buf = img->buf;
+    uintptr_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t fat = (uintptr_t)(image_buf + geom->fat_offset);
+    uintptr_t start = fat & ~pagemask;
+    uintptr_t root_end = (uintptr_t)(image_buf + geom->data_offset);
+    uintptr_t fat_end = fat + (uint64_t)geom->fat_secs * geom->bytes_per_sec;
+
+    if (root_end > (uintptr_t)image_buf + img->size)
+	return;
+    madvise((void *)start, fat_end - start, MADV_SEQUENTIAL);
+    madvise((void *)start, root_end - start, MADV_WILLNEED);
+}
+
+
+/* read the bootsector from the disk, and check that it is sane.
+   Returns FALSE if the geometry can't be worked out from it. */
 /* define DEBUG to see what the disk parameters actually are */
 
-struct bpb33* check_bootsector(uint8_t *image_buf)
+static int check_bootsector(struct dosimage *img)
 {
+    uint8_t sector[sizeof(struct bootsector33)];
     struct bootsector33* bootsect;
-    struct byte_bpb33* bpb;  /* BIOS parameter block */
-    struct bpb33* bpb_aligned;
+    struct byte_bpb710* bpb;  /* BIOS parameter block */
+    struct bpb33* bpb_aligned = &img->bpb;
+    struct dosgeom* geom = &img->geom;
+    uint32_t rootsecs, datasecs;
+    uint64_t metasecs, fatents;
 
 #ifdef DEBUG
     fprintf(stderr, "Size of BPB: %lu\n", sizeof(struct bootsector33));
 #endif
 
-    bootsect = (struct bootsector33*)image_buf;
+    if (img->size < sizeof(sector))
+    {
+	fprintf(stderr, "Disk image is too small to hold a boot sector\n");
+	return FALSE;
+    }
+    bootsect = (struct bootsector33*)img->ops->read(img, 0, sizeof(sector),
+						    sector);
     if (bootsect->bsJump[0] == 0xe9 ||
 	(bootsect->bsJump[0] == 0xeb && bootsect->bsJump[2] == 0x90)) 
     {
@@ -135,13 +521,14 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
 		bootsect->bsBootSectSig1);
     }
 
-    bpb = (struct byte_bpb33*)&(bootsect->bsBPB[0]);
+    /* the DOS 3.3 fields are a prefix of the DOS 7.10 (FAT32) BPB, so
+       read it as the larger one; the extra fields only mean anything
+       when the 3.3 ones are zero */
+    bpb = (struct byte_bpb710*)&(bootsect->bsBPB[0]);
 
     /* bpb is a byte-based struct, because this data is unaligned.
        This makes it hard to access the multi-byte fields, so we copy
        it to a slightly larger struct that is word-aligned */
-    bpb_aligned = malloc(sizeof(struct bpb33));
-
     bpb_aligned->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
     bpb_aligned->bpbSecPerClust = bpb->bpbSecPerClust;
     bpb_aligned->bpbResSectors = getushort(bpb->bpbResSectors);
@@ -150,7 +537,108 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     bpb_aligned->bpbSectors = getushort(bpb->bpbSectors);
     bpb_aligned->bpbFATsecs = getushort(bpb->bpbFATsecs);
     bpb_aligned->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
-    
+
+    if (bpb_aligned->bpbBytesPerSec == 0 || bpb_aligned->bpbSecPerClust == 0)
+    {
+	fprintf(stderr, "Not a FAT file system: bad sector or cluster size\n");
+	return FALSE;
+    }
+
+    /* work out the layout.  FAT16 and FAT32 volumes keep a 32-bit
+       sector count (and FAT32 a 32-bit FAT size) when the 16-bit
+       fields are zero */
+    geom->bytes_per_sec = bpb_aligned->bpbBytesPerSec;
+    geom->clust_size = bpb_aligned->bpbBytesPerSec * bpb_aligned->bpbSecPerClust;
+    geom->total_secs = bpb_aligned->bpbSectors ? bpb_aligned->bpbSectors 
+	: getulong(bpb->bpbHugeSectors);
+    geom->fat_secs = bpb_aligned->bpbFATsecs ? bpb_aligned->bpbFATsecs
+	: getulong(bpb->bpbBigFATsecs);
+    geom->root_ents = bpb_aligned->bpbRootDirEnts;
+    rootsecs = (geom->root_ents * sizeof(struct direntry) 
+		+ geom->bytes_per_sec - 1) / geom->bytes_per_sec;
+
+    geom->fat_offset = (uint64_t)bpb_aligned->bpbResSectors * geom->bytes_per_sec;
+    geom->root_offset = geom->fat_offset 
+	+ (uint64_t)bpb_aligned->bpbFATs * geom->fat_secs * geom->bytes_per_sec;
+    geom->data_offset = geom->root_offset 
+	+ (uint64_t)rootsecs * geom->bytes_per_sec;
+
+    metasecs = bpb_aligned->bpbResSectors 
+	+ (uint64_t)bpb_aligned->bpbFATs * geom->fat_secs + rootsecs;
+    if (geom->total_secs < metasecs)
+    {
+	fprintf(stderr, "Not a FAT file system: %u sectors can't hold the "
+		"%llu sectors of FATs and root directory\n", geom->total_secs,
+		(unsigned long long)metasecs);
+	return FALSE;
+    }
+    datasecs = geom->total_secs - metasecs;
+    geom->max_cluster = datasecs / bpb_aligned->bpbSecPerClust + CLUST_FIRST;
+
+    /* the FAT type follows from the cluster count alone; these are
+       the thresholds Microsoft's own FAT code uses */
+    if (geom->max_cluster - CLUST_FIRST < 4085)
+    {
+	geom->fattype = 12;
+	geom->fatmask = FAT12_MASK;
+    }
+    else if (geom->max_cluster - CLUST_FIRST < 65525)
+    {
+	geom->fattype = 16;
+	geom->fatmask = FAT16_MASK;
+    }
+    else
+    {
+	geom->fattype = 32;
+	geom->fatmask = FAT32_MASK;
+    }
+
+    /* every cluster needs a FAT entry; count them the way the FAT
+       cache does, so its accessors never see a cluster past the end */
+    fatents = (uint64_t)geom->fat_secs * geom->bytes_per_sec * 8 / geom->fattype;
+    if (geom->fattype == 12)
+	fatents &= ~1;
+    if (geom->max_cluster > fatents)
+    {
+	fprintf(stderr, "Not a FAT file system: %u clusters, but the FAT "
+		"only has room for %llu\n", geom->max_cluster - CLUST_FIRST,
+		fatents < CLUST_FIRST ? 0ULL
+		: (unsigned long long)(fatents - CLUST_FIRST));
+	return FALSE;
+    }
+
+    geom->root_cluster = 0;
+    if (geom->fattype == 32)
+    {
+	/* the FAT32 root directory is an ordinary cluster chain */
+	geom->root_cluster = getulong(bpb->bpbRootClust);
+	if (geom->root_cluster < CLUST_FIRST
+	    || geom->root_cluster >= geom->max_cluster)
+	{
+	    fprintf(stderr, "Not a FAT file system: root directory cluster "
+		    "%u isn't in the data area\n", geom->root_cluster);
+	    return FALSE;
+	}
+	geom->root_offset = geom->data_offset 
+	    + (uint64_t)geom->clust_size * (geom->root_cluster - CLUST_FIRST);
+    }
+
+    if (geom->data_offset > img->size)
+    {
+	fprintf(stderr, "Disk image is smaller than its FATs and root directory\n");
+	return FALSE;
+    }
+    if (geom->data_offset 
+	+ (uint64_t)geom->clust_size * (geom->max_cluster - CLUST_FIRST)
+	> img->size)
+    {
+	fprintf(stderr, "Disk image is smaller than the %u clusters its boot "
+		"sector claims\n", geom->max_cluster - CLUST_FIRST);
+	return FALSE;
+    }
+
+    if (img->buf != NULL)
+	advise_metadata(img);
 
 #ifdef DEBUG
     fprintf(stderr, "Bytes per sector: %d\n", bpb_aligned->bpbBytesPerSec);
@@ -161,79 +649,953 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     fprintf(stderr, "Total number of sectors: %d\n", bpb_aligned->bpbSectors);
     fprintf(stderr, "Number of sectors per FAT: %d\n", bpb_aligned->bpbFATsecs);
     fprintf(stderr, "Number of hidden sectors: %d\n", bpb_aligned->bpbHiddenSecs);
+    fprintf(stderr, "FAT type: FAT%d (%u clusters)\n", geom->fattype,
+	    geom->max_cluster - CLUST_FIRST);
 #endif
 
-    return bpb_aligned;
+    return TRUE;
+}
+
+/* open_image opens the image, reads its boot sector and loads its
+   FAT cache.  On failure it says why and returns NULL.  Setting
+   DOSIMAGE_PREAD in the environment gets the pread backend without
+   changing the tools. */
+struct dosimage *open_image(char *filename, int flags)
+{
+    struct dosimage *img;
+
+    img = calloc(1, sizeof(struct dosimage));
+    img->flags = flags;
+    if (getenv("DOSIMAGE_PREAD") != NULL)
+	img->flags |= IMAGE_PREAD;
+    if (!open_file(img, filename))
+    {
+	free(img);
+	return NULL;
+    }
+    if (!check_bootsector(img))
+    {
+	close_file(img);
+	free(img);
+	return NULL;
+    }
+    img->fatc = fat_cache_load(img);
+    return img;
+}
+
+/* close_image writes back the FAT cache, syncs and closes the image
+   and frees the handle.  FAT entries set on a read-only image were
+   only ever in memory, and go away with it. */
+void close_image(struct dosimage *img)
+{
+    if ((img->flags & IMAGE_RDONLY) == 0)
+	fat_cache_flush(img->fatc);
+    fat_cache_free(img->fatc);
+    close_file(img);
+    free(img);
+}
+
+/* get_geometry returns the layout worked out when the image was opened */
+const struct dosgeom *get_geometry(struct dosimage *img)
+{
+    return &img->geom;
+}
+
+/* image_backend names the backend the image ended up with */
+const char *image_backend(struct dosimage *img)
+{
+    return img->ops->name;
+}
+
+/* Per-width FAT accessors.  Each one is specialised for its entry
+   size so the FAT-12 path keeps its shifts and FAT-16/FAT-32 are a
+   plain word or dword load.  Like the rest of this file they assume a
+   little-endian CPU. */
+
+static inline uint32_t fat12_read(const uint8_t *fat, uint32_t clusternum)
+{
+    const uint8_t *p = fat + 3 * (clusternum/2);
+
+    /* mjh: little-endian CPUs are ugly! */
+    if (clusternum % 2 == 0)
+	return ((0x0f & p[1]) << 8) | p[0];
+    return p[2] << 4 | ((0xf0 & p[1]) >> 4);
+}
+
+static inline void fat12_write(uint8_t *fat, uint32_t clusternum, 
+			       uint32_t value)
+{
+    uint8_t *p = fat + 3 * (clusternum/2);
+
+    /* mjh: little-endian CPUs are really ugly! */
+    if (clusternum % 2 == 0)
+    {
+	p[0] = (uint8_t)(0xff & value);
+	p[1] = (uint8_t)((0xf0 & p[1]) | (0x0f & (value >> 8)));
+    }
+    else
+    {
+	p[1] = (uint8_t)((0x0f & p[1]) | ((0x0f & value) << 4));
+	p[2] = (uint8_t)(0xff & (value >> 4));
+    }
+}
+
+static inline uint32_t fat16_read(const uint8_t *fat, uint32_t clusternum)
+{
+    uint16_t value;
+    memcpy(&value, fat + 2 * clusternum, 2);
+    return value;
+}
+
+static inline void fat16_write(uint8_t *fat, uint32_t clusternum, 
+			       uint32_t value)
+{
+    uint16_t v = (uint16_t)value;
+    memcpy(fat + 2 * clusternum, &v, 2);
+}
+
+static inline uint32_t fat32_read(const uint8_t *fat, uint32_t clusternum)
+{
+    uint32_t value;
+    memcpy(&value, fat + 4 * clusternum, 4);
+    return value & FAT32_MASK;
+}
+
+/* the top 4 bits of a FAT-32 entry are reserved and must be kept */
+static inline void fat32_write(uint8_t *fat, uint32_t clusternum, 
+			       uint32_t value)
+{
+    uint32_t v;
+    memcpy(&v, fat + 4 * clusternum, 4);
+    v = (v & ~FAT32_MASK) | (value & FAT32_MASK);
+    memcpy(fat + 4 * clusternum, &v, 4);
+}
+
+/* fat_canon widens the reserved/bad/EOF values of a narrow FAT to the
+   32-bit CLUST_* constants, so callers never need to know the FAT
+   width to recognise them */
+static inline uint32_t fat_canon(uint32_t value, uint32_t mask)
+{
+    if (value >= (mask & CLUST_RSRVDS))
+	value |= ~mask;
+    return value;
+}
+
+/* Bulk FAT-12 codecs.  Every 3 bytes of a FAT-12 hold two entries,
+   so decoding is a 3-bytes-to-2-entries shuffle followed by a mask
+   and a shift.  The scalar versions work everywhere; on x86 the SSSE3
+   and AVX2 versions do the shuffle with pshufb, 8 or 16 entries at a
+   time.  fat12_unpack/fat12_pack pick the best one the CPU supports
+   the first time they are called. */
+
+static void fat12_unpack_scalar(const uint8_t *src, uint16_t *dst,
+				uint32_t ngroups)
+{
+    uint32_t i;
+    for (i = 0; i < ngroups; i++, src += 3)
+    {
+	dst[2*i] = ((0x0f & src[1]) << 8) | src[0];
+	dst[2*i + 1] = (src[2] << 4) | ((0xf0 & src[1]) >> 4);
+    }
+}
+
+static void fat12_pack_scalar(const uint16_t *src, uint8_t *dst,
+			      uint32_t ngroups)
+{
+    uint32_t i;
+    for (i = 0; i < ngroups; i++, dst += 3)
+    {
+	dst[0] = (uint8_t)(0xff & src[2*i]);
+	dst[1] = (uint8_t)((0x0f & (src[2*i] >> 8)) 
+			   | ((0x0f & src[2*i + 1]) << 4));
+	dst[2] = (uint8_t)(0xff & (src[2*i + 1] >> 4));
+    }
+}
+
+static int fat12_scalar_supported(void)
+{
+    return TRUE;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define FAT12_SSSE3 __attribute__((target("ssse3")))
+#define FAT12_AVX2 __attribute__((target("avx2")))
+
+/* The shuffle puts the two bytes each entry lives in into its 16-bit
+   lane; even entries are then masked to 12 bits and odd entries are
+   shifted down by 4. */
+FAT12_SSSE3 static inline __m128i fat12_decode_x8(__m128i v)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+				       6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i even = _mm_set1_epi32(0x00000fff);
+    const __m128i odd = _mm_set1_epi32((int)0xffff0000);
+    v = _mm_shuffle_epi8(v, shuf);
+    return _mm_or_si128(_mm_and_si128(v, even),
+			_mm_and_si128(_mm_srli_epi16(v, 4), odd));
+}
+
+/* Each pair of entries becomes one 24-bit value in a 32-bit lane,
+   and the shuffle squeezes the four 3-byte groups together. */
+FAT12_SSSE3 static inline __m128i fat12_encode_x8(__m128i v)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+				       10, 12, 13, 14, -1, -1, -1, -1);
+    v = _mm_and_si128(v, _mm_set1_epi16(0x0fff));
+    v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0x00000fff)),
+		     _mm_and_si128(_mm_srli_epi32(v, 4),
+				   _mm_set1_epi32(0x00fff000)));
+    return _mm_shuffle_epi8(v, shuf);
+}
+
+FAT12_SSSE3 static inline void fat12_store12(uint8_t *dst, __m128i v)
+{
+    uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+    _mm_storel_epi64((__m128i *)dst, v);
+    memcpy(dst + 8, &tail, 4);
+}
+
+FAT12_SSSE3 static void fat12_unpack_ssse3(const uint8_t *src, uint16_t *dst,
+					   uint32_t ngroups)
+{
+    uint32_t i = 0;
+
+    /* each step reads 16 bytes but only consumes 12, so stop early
+       enough not to read past the end of the FAT */
+    for ( ; i + 6 <= ngroups; i += 4)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)(src + 3*i));
+	_mm_storeu_si128((__m128i *)(dst + 2*i), fat12_decode_x8(v));
+    }
+    fat12_unpack_scalar(src + 3*i, dst + 2*i, ngroups - i);
+}
+
+FAT12_SSSE3 static void fat12_pack_ssse3(const uint16_t *src, uint8_t *dst,
+					 uint32_t ngroups)
+{
+    uint32_t i = 0;
+    for ( ; i + 4 <= ngroups; i += 4)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)(src + 2*i));
+	fat12_store12(dst + 3*i, fat12_encode_x8(v));
+    }
+    fat12_pack_scalar(src + 2*i, dst + 3*i, ngroups - i);
 }
 
+FAT12_AVX2 static void fat12_unpack_avx2(const uint8_t *src, uint16_t *dst,
+					 uint32_t ngroups)
+{
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+					  6, 7, 7, 8, 9, 10, 10, 11,
+					  0, 1, 1, 2, 3, 4, 4, 5,
+					  6, 7, 7, 8, 9, 10, 10, 11);
+    const __m256i even = _mm256_set1_epi32(0x00000fff);
+    const __m256i odd = _mm256_set1_epi32((int)0xffff0000);
+    uint32_t i = 0;
+
+    /* pshufb works within 128-bit lanes, so the upper lane is loaded
+       from 12 bytes further on; that load reads up to byte 27 */
+    for ( ; i + 10 <= ngroups; i += 8)
+    {
+	const uint8_t *p = src + 3*i;
+	__m256i v = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+	    _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+	v = _mm256_shuffle_epi8(v, shuf);
+	v = _mm256_or_si256(_mm256_and_si256(v, even),
+			    _mm256_and_si256(_mm256_srli_epi16(v, 4), odd));
+	_mm256_storeu_si256((__m256i *)(dst + 2*i), v);
+    }
+    fat12_unpack_ssse3(src + 3*i, dst + 2*i, ngroups - i);
+}
+
+FAT12_AVX2 static void fat12_pack_avx2(const uint16_t *src, uint8_t *dst,
+				       uint32_t ngroups)
+{
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+					  10, 12, 13, 14, -1, -1, -1, -1,
+					  0, 1, 2, 4, 5, 6, 8, 9,
+					  10, 12, 13, 14, -1, -1, -1, -1);
+    uint32_t i = 0;
+    for ( ; i + 8 <= ngroups; i += 8)
+    {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(src + 2*i));
+	v = _mm256_and_si256(v, _mm256_set1_epi16(0x0fff));
+	v = _mm256_or_si256(
+	    _mm256_and_si256(v, _mm256_set1_epi32(0x00000fff)),
+	    _mm256_and_si256(_mm256_srli_epi32(v, 4),
+			     _mm256_set1_epi32(0x00fff000)));
+	v = _mm256_shuffle_epi8(v, shuf);
+	fat12_store12(dst + 3*i, _mm256_castsi256_si128(v));
+	fat12_store12(dst + 3*i + 12, _mm256_extracti128_si256(v, 1));
+    }
+    fat12_pack_ssse3(src + 2*i, dst + 3*i, ngroups - i);
+}
+
+static int fat12_ssse3_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int fat12_avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/* best first; the scalar codec must stay last */
+const struct fat12_codec fat12_codecs[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", fat12_avx2_supported, fat12_unpack_avx2, fat12_pack_avx2 },
+    { "ssse3", fat12_ssse3_supported, fat12_unpack_ssse3, fat12_pack_ssse3 },
+#endif
+    { "scalar", fat12_scalar_supported, fat12_unpack_scalar, fat12_pack_scalar },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const struct fat12_codec *fat12_codec = NULL;
+
+/* fat12_best_codec returns the fastest codec this CPU can run */
+const struct fat12_codec *fat12_best_codec(void)
+{
+    const struct fat12_codec *c;
+    if (fat12_codec == NULL)
+    {
+	for (c = fat12_codecs; !c->supported(); c++)
+	    ;
+	fat12_codec = c;
+    }
+    return fat12_codec;
+}
+
+/* fat12_unpack decodes ngroups 3-byte groups from src into
+   2*ngroups entries in dst */
+void fat12_unpack(const uint8_t *src, uint16_t *dst, uint32_t ngroups)
+{
+    fat12_best_codec()->unpack(src, dst, ngroups);
+}
+
+/* fat12_pack encodes 2*ngroups entries from src into ngroups 3-byte
+   groups in dst.  Only the low 12 bits of each entry are stored. */
+void fat12_pack(const uint16_t *src, uint8_t *dst, uint32_t ngroups)
+{
+    fat12_best_codec()->pack(src, dst, ngroups);
+}
+
+
+/* The FAT cache holds the whole FAT-12 unpacked into one uint16_t per
+   cluster, so lookups are a plain array index rather than a 12-bit
+   unpack against the image.  Each pair of entries shares a 3-byte
+   group on disk; set_fat_entry-style writes only mark that group
+   dirty, and fat_cache_flush repacks just the dirty groups back into
+   the image.  FAT-16 and FAT-32 entries are already a direct load, so
+   for those the cache just reads and writes the image.
+
+   An image that isn't mapped gets a private copy of the FAT instead,
+   with one dirty bit per sector, and flushing writes the dirty
+   sectors back through the backend. */
+struct fatcache {
+    int fattype;		/* 12, 16 or 32 */
+    struct dosimage *img;
+    uint8_t *fat;		/* first FAT, mapped or copied */
+    uint32_t nentries;		/* number of entries in the FAT */
+    uint32_t max_cluster;	/* one past the last data cluster */
+    uint16_t *entries;		/* unpacked FAT entries (FAT-12 only) */
+    uint8_t *dirty;		/* one bit per 3-byte group (FAT-12 only) */
+    uint8_t *copy;		/* the private copy, or NULL if mapped */
+    uint8_t *dirtysecs;		/* one bit per sector of the copy */
+};
+
+/* mark_fat_bytes records that nbytes of the FAT copy at offset off
+   need writing back */
+static void mark_fat_bytes(struct fatcache *fc, uint32_t off, uint32_t nbytes)
+{
+    uint32_t secsize = fc->img->geom.bytes_per_sec;
+    uint32_t sec;
+
+    if (fc->copy == NULL)
+	return;
+    for (sec = off / secsize; sec <= (off + nbytes - 1) / secsize; sec++)
+	fc->dirtysecs[sec / 8] |= 1 << (sec % 8);
+}
+
+/* fat_cache_load unpacks the first FAT of the image into a new cache */
+static struct fatcache *fat_cache_load(struct dosimage *img)
+{
+    const struct dosgeom *geom = &img->geom;
+    struct fatcache *fc;
+    uint32_t fatbytes, ngroups;
+
+    fc = malloc(sizeof(struct fatcache));
+    fc->fattype = geom->fattype;
+    fc->img = img;
+    fc->max_cluster = geom->max_cluster;
+    fatbytes = geom->fat_secs * geom->bytes_per_sec;
+    fc->entries = NULL;
+    fc->dirty = NULL;
+    fc->copy = NULL;
+    fc->dirtysecs = NULL;
+    if (img->buf != NULL
+	&& (fc->fattype == 12 || (img->flags & IMAGE_RDONLY) == 0))
+    {
+	fc->fat = img->buf + geom->fat_offset;
+    }
+    else
+    {
+	/* a read-only mapping can't take FAT-16/32 entries set in
+	   memory, so those get a private copy too */
+	fc->copy = malloc(fatbytes);
+	fc->dirtysecs = calloc((geom->fat_secs + 7) / 8, 1);
+	fc->fat = img->ops->read(img, geom->fat_offset, fatbytes, fc->copy);
+	if (fc->fat != fc->copy)
+	{
+	    memcpy(fc->copy, fc->fat, fatbytes);
+	    fc->fat = fc->copy;
+	}
+    }
+    if (fc->fattype != 12)
+    {
+	fc->nentries = fatbytes / (fc->fattype / 8);
+	return fc;
+    }
+
+    ngroups = fatbytes / 3;
+    fc->nentries = ngroups * 2;
+    fc->entries = malloc(fc->nentries * sizeof(uint16_t));
+    fc->dirty = calloc((ngroups + 7) / 8, 1);
+
+    fat12_unpack(fc->fat, fc->entries, ngroups);
+    return fc;
+}
+
+/* Per-width accessors on the cache.  fat_cache_get/fat_cache_set pick
+   one at run time for a single entry; the loops that touch many
+   entries (get_extents, set_fat_chain, get_fat_entries) switch on the
+   width once and run a copy of the loop built around one of these, as
+   freemap_load does, so the FAT-12 path costs no more than it did
+   before the wider FATs came along. */
+
+static inline uint32_t fat12_get(struct fatcache *fc, uint32_t clusternum)
+{
+    return fat_canon(fc->entries[clusternum], FAT12_MASK);
+}
+
+static inline uint32_t fat16_get(struct fatcache *fc, uint32_t clusternum)
+{
+    return fat_canon(fat16_read(fc->fat, clusternum), FAT16_MASK);
+}
+
+static inline uint32_t fat32_get(struct fatcache *fc, uint32_t clusternum)
+{
+    return fat_canon(fat32_read(fc->fat, clusternum), FAT32_MASK);
+}
+
+/* for FAT-12 the image isn't touched until fat_cache_flush */
+static inline void fat12_set(struct fatcache *fc, uint32_t clusternum,
+			     uint32_t value)
+{
+    uint32_t group = clusternum / 2;
+
+    fc->entries[clusternum] = value & FAT12_MASK;
+    fc->dirty[group / 8] |= 1 << (group % 8);
+}
+
+static inline void fat16_set(struct fatcache *fc, uint32_t clusternum,
+			     uint32_t value)
+{
+    fat16_write(fc->fat, clusternum, value);
+    mark_fat_bytes(fc, 2 * clusternum, 2);
+}
+
+static inline void fat32_set(struct fatcache *fc, uint32_t clusternum,
+			     uint32_t value)
+{
+    fat32_write(fc->fat, clusternum, value);
+    mark_fat_bytes(fc, 4 * clusternum, 4);
+}
+
+/* fat_cache_get returns the cached FAT entry for clusternum */
+static uint32_t fat_cache_get(struct fatcache *fc, uint32_t clusternum)
+{
+    assert(clusternum < fc->nentries);
+    switch (fc->fattype)
+    {
+    case 12:
+	return fat12_get(fc, clusternum);
+    case 16:
+	return fat16_get(fc, clusternum);
+    default:
+	return fat32_get(fc, clusternum);
+    }
+}
+
+/* fat_cache_set updates the cached FAT entry for clusternum */
+static void fat_cache_set(struct fatcache *fc, uint32_t clusternum, 
+			  uint32_t value)
+{
+    assert(clusternum < fc->nentries);
+    switch (fc->fattype)
+    {
+    case 12:
+	fat12_set(fc, clusternum, value);
+	break;
+    case 16:
+	fat16_set(fc, clusternum, value);
+	break;
+    default:
+	fat32_set(fc, clusternum, value);
+	break;
+    }
+}
+
+/* write_fat_copy writes the dirty sectors of a private FAT copy back
+   to the image, a run of consecutive sectors at a time */
+static void write_fat_copy(struct fatcache *fc)
+{
+    struct dosimage *img = fc->img;
+    uint32_t secsize = img->geom.bytes_per_sec;
+    uint32_t nsecs = img->geom.fat_secs;
+    uint32_t sec, run;
+
+    for (sec = 0; sec < nsecs; sec++)
+    {
+	if ((fc->dirtysecs[sec / 8] & (1 << (sec % 8))) == 0)
+	    continue;
+	for (run = sec; run < nsecs 
+		 && (fc->dirtysecs[run / 8] & (1 << (run % 8))); run++)
+	    fc->dirtysecs[run / 8] &= ~(1 << (run % 8));
+	img->ops->write(img, img->geom.fat_offset + (uint64_t)sec * secsize,
+			(uint64_t)(run - sec) * secsize,
+			fc->copy + sec * secsize);
+	sec = run;
+    }
+}
+
+/* fat_cache_flush repacks the dirty 3-byte groups into the image, and
+   writes a private copy back */
+static void fat_cache_flush(struct fatcache *fc)
+{
+    uint32_t ngroups = fc->nentries / 2;
+    uint32_t nbytes = (ngroups + 7) / 8;
+    uint32_t group, i, run;
+
+    if (fc->fattype != 12)
+    {
+	if (fc->copy != NULL)
+	    write_fat_copy(fc);
+	return;
+    }
+
+    for (i = 0; i < nbytes; i++)
+    {
+	if (fc->dirty[i] == 0)
+	    continue;
+
+	/* runs of fully dirty groups get repacked in bulk */
+	for (run = i; run < nbytes && fc->dirty[run] == 0xff; run++)
+	    ;
+	if (run > i)
+	{
+	    group = i * 8;
+	    fat12_pack(fc->entries + 2*group, fc->fat + 3*group,
+		       (run - i) * 8);
+	    mark_fat_bytes(fc, 3*group, 3 * (run - i) * 8);
+	    memset(fc->dirty + i, 0, run - i);
+	    i = run - 1;
+	    continue;
+	}
+
+	for (group = i * 8; group < i * 8 + 8 && group < ngroups; group++)
+	{
+	    if (fc->dirty[i] & (1 << (group % 8)))
+	    {
+		fat12_pack(fc->entries + 2*group, fc->fat + 3*group, 1);
+		mark_fat_bytes(fc, 3*group, 3);
+	    }
+	}
+	fc->dirty[i] = 0;
+    }
+    if (fc->copy != NULL)
+	write_fat_copy(fc);
+}
+
+/* fat_cache_free releases the cache without flushing it */
+static void fat_cache_free(struct fatcache *fc)
+{
+    free(fc->entries);
+    free(fc->dirty);
+    free(fc->copy);
+    free(fc->dirtysecs);
+    free(fc);
+}
+
+
 /* get_fat_entry returns the value from the FAT entry for
    clusternum. */
-uint16_t get_fat_entry(uint16_t clusternum, 
-		       uint8_t *image_buf, struct bpb33* bpb)
+uint32_t get_fat_entry(struct dosimage *img, uint32_t clusternum)
 {
-    uint32_t offset;
-    uint16_t value;
-    uint8_t b1, b2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
-    {
-    case 0:
-	b1 = *(image_buf + offset);
-	b2 = *(image_buf + offset + 1);
-
-	/* mjh: little-endian CPUs are ugly! */
-	value = ((0x0f & b2) << 8) | b1;
+    return fat_cache_get(img->fatc, clusternum);
+}
+
+
+/* set_fat_entry sets the value of the FAT entry for clusternum to
+   value.  Values are truncated to the width of the FAT, so CLUST_EOFS
+   and friends can be passed as they are. */
+void set_fat_entry(struct dosimage *img, uint32_t clusternum, uint32_t value)
+{
+    fat_cache_set(img->fatc, clusternum, value);
+}
+
+#define FAT_GET_RANGE(fc, get, first, n, out)				\
+    do {								\
+	uint32_t i_;							\
+	for (i_ = 0; i_ < (n); i_++)					\
+	    (out)[i_] = get(fc, (first) + i_);				\
+    } while (0)
+
+/* get_fat_entries fills out with the n FAT entries starting at
+   first, as get_fat_entry would return them, for callers that want
+   the whole FAT or a large part of it */
+void get_fat_entries(struct dosimage *img, uint32_t first, uint32_t n,
+		     uint32_t *out)
+{
+    struct fatcache *fc = img->fatc;
+
+    if (n == 0)
+	return;
+    assert(first + n <= fc->nentries);
+    switch (fc->fattype)
+    {
+    case 12:
+	FAT_GET_RANGE(fc, fat12_get, first, n, out);
 	break;
-    case 1:
-	b1 = *(image_buf + offset + 1);
-	b2 = *(image_buf + offset + 2);
-	value = b2 << 4 | ((0xf0 & b1) >> 4);
+    case 16:
+	FAT_GET_RANGE(fc, fat16_get, first, n, out);
+	break;
+    default:
+	FAT_GET_RANGE(fc, fat32_get, first, n, out);
 	break;
     }
-    return value;
 }
 
 
-/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
-void set_fat_entry(uint16_t clusternum, uint16_t value,
-		   uint8_t *image_buf, struct bpb33* bpb)
+#define EXTENTS_WALK(fc, get, ex, start)				\
+    do {								\
+	uint32_t c_ = (start), cap_ = 4;				\
+	while (c_ >= CLUST_FIRST && c_ < (fc)->max_cluster		\
+	       && (ex)->nclusters < (fc)->max_cluster)			\
+	{								\
+	    if ((ex)->count > 0						\
+		&& (ex)->ext[(ex)->count-1].start			\
+		   + (ex)->ext[(ex)->count-1].length == c_)		\
+	    {								\
+		(ex)->ext[(ex)->count-1].length++;			\
+	    }								\
+	    else							\
+	    {								\
+		if ((ex)->count == cap_)				\
+		{							\
+		    cap_ *= 2;						\
+		    (ex)->ext = realloc((ex)->ext,			\
+					cap_ * sizeof(struct extent));	\
+		}							\
+		(ex)->ext[(ex)->count].start = c_;			\
+		(ex)->ext[(ex)->count].length = 1;			\
+		(ex)->count++;						\
+	    }								\
+	    (ex)->nclusters++;						\
+	    c_ = get(fc, c_);						\
+	    (ex)->end = c_;						\
+	}								\
+    } while (0)
+
+/* get_extents walks the cluster chain starting at start once and
+   returns it as a list of runs of consecutive clusters, so readers can
+   handle a whole run with one call.  The walk stops at the first FAT
+   value that isn't a data cluster, and that value is left in end; a
+   chain that loops is cut off once it is longer than the volume. */
+struct extents *get_extents(struct dosimage *img, uint32_t start)
 {
-    uint32_t offset;
-    uint8_t *p1, *p2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
+    struct fatcache *fc = img->fatc;
+    struct extents *ex;
+
+    ex = malloc(sizeof(struct extents));
+    ex->count = 0;
+    ex->nclusters = 0;
+    ex->end = start;
+    ex->ext = malloc(4 * sizeof(struct extent));
+
+    switch (fc->fattype)
     {
-    case 0:
-	p1 = image_buf + offset;
-	p2 = image_buf + offset + 1;
-	/* mjh: little-endian CPUs are really ugly! */
-	*p1 = (uint8_t)(0xff & value);
-	*p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
+    case 12:
+	EXTENTS_WALK(fc, fat12_get, ex, start);
+	break;
+    case 16:
+	EXTENTS_WALK(fc, fat16_get, ex, start);
 	break;
-    case 1:
-	p1 = image_buf + offset + 1;
-	p2 = image_buf + offset + 2;
-	*p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
-	*p2 = (uint8_t)(0xff & (value >> 4));
+    default:
+	EXTENTS_WALK(fc, fat32_get, ex, start);
 	break;
     }
+    return ex;
 }
 
+/* free_extents releases a list from get_extents */
+void free_extents(struct extents *ex)
+{
+    free(ex->ext);
+    free(ex);
+}
 
-int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
+#define FAT_SET_CHAIN(fc, set, ex)					\
+    do {								\
+	uint32_t i_, c_, end_;						\
+	for (i_ = 0; i_ < (ex)->count; i_++)				\
+	{								\
+	    end_ = (ex)->ext[i_].start + (ex)->ext[i_].length - 1;	\
+	    assert(end_ < (fc)->nentries);				\
+	    for (c_ = (ex)->ext[i_].start; c_ < end_; c_++)		\
+		set(fc, c_, c_ + 1);					\
+	    set(fc, end_, i_ + 1 < (ex)->count				\
+		? (ex)->ext[i_+1].start : CLUST_EOFS);			\
+	}								\
+    } while (0)
+
+/* set_fat_chain writes the FAT entries for a whole chain in one go:
+   each cluster in the runs points to the next, and the last one ends
+   the chain.  Within a run that is just an increasing count. */
+void set_fat_chain(struct dosimage *img, const struct extents *ex)
 {
-    uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
-    if (cluster >= (FAT12_MASK & CLUST_FIRST) && 
-        cluster <= (FAT12_MASK & CLUST_LAST) &&
-        cluster < max_cluster)
+    struct fatcache *fc = img->fatc;
+
+    switch (fc->fattype)
+    {
+    case 12:
+	FAT_SET_CHAIN(fc, fat12_set, ex);
+	break;
+    case 16:
+	FAT_SET_CHAIN(fc, fat16_set, ex);
+	break;
+    default:
+	FAT_SET_CHAIN(fc, fat32_set, ex);
+	break;
+    }
+}
+
+
+/* The free map is a bitmap with one bit per cluster, set when the
+   cluster is free.  It is built with one pass over the FAT, and after
+   that allocation is a find-first-set over 64-bit words starting at
+   the lowest word that can still hold a free cluster, so it hands out
+   clusters in the same first-fit order as scanning the FAT from
+   cluster 2, without rescanning it.  freemap_alloc_run instead hands
+   out whole runs, for files whose size is known up front.  The map
+   only tracks free space; callers still write the FAT themselves. */
+struct freemap {
+    uint32_t max_cluster;	/* one past the last data cluster */
+    uint32_t nwords;
+    uint32_t hint;		/* no free bits in words below this */
+    uint64_t *bits;
+};
+
+#define FREEMAP_SCAN(fm, read, fat)					\
+    do {								\
+	uint32_t c_;							\
+	for (c_ = CLUST_FIRST; c_ < (fm)->max_cluster; c_++)		\
+	    if (read(fat, c_) == CLUST_FREE)				\
+		(fm)->bits[c_ / 64] |= (uint64_t)1 << (c_ % 64);	\
+    } while (0)
+
+/* freemap_load builds the free map from the image's FAT cache */
+struct freemap *freemap_load(struct dosimage *img)
+{
+    const struct dosgeom *geom = &img->geom;
+    uint8_t *fat = img->fatc->fat;
+    struct freemap *fm;
+
+    /* the scan reads the packed FAT, so bring it up to date first */
+    fat_cache_flush(img->fatc);
+
+    fm = malloc(sizeof(struct freemap));
+    fm->max_cluster = geom->max_cluster;
+    fm->nwords = (geom->max_cluster + 63) / 64;
+    fm->hint = 0;
+    fm->bits = calloc(fm->nwords, sizeof(uint64_t));
+
+    /* the width switch sits outside the loop, so each scan is
+       specialised for its accessor */
+    switch (geom->fattype)
+    {
+    case 12:
+	FREEMAP_SCAN(fm, fat12_read, fat);
+	break;
+    case 16:
+	FREEMAP_SCAN(fm, fat16_read, fat);
+	break;
+    default:
+	FREEMAP_SCAN(fm, fat32_read, fat);
+	break;
+    }
+    return fm;
+}
+
+/* freemap_alloc returns the lowest free cluster and marks it used, or
+   returns 0 if the volume is full */
+uint32_t freemap_alloc(struct freemap *fm)
+{
+    uint32_t w, cluster;
+
+    for (w = fm->hint; w < fm->nwords; w++)
+    {
+	if (fm->bits[w] != 0)
+	{
+	    cluster = w * 64 + __builtin_ctzll(fm->bits[w]);
+	    fm->bits[w] &= fm->bits[w] - 1;
+	    fm->hint = w;
+	    return cluster;
+	}
+    }
+    fm->hint = fm->nwords;
+    return 0;
+}
+
+/* next_free_run finds the first run of free clusters at or after
+   from, returning where it starts and setting *len, or returning 0 if
+   there are none.  Bits past the last cluster are never set, so a run
+   can't go past it. */
+static uint32_t next_free_run(struct freemap *fm, uint32_t from, uint32_t *len)
+{
+    uint32_t w = from / 64, start;
+    uint64_t bits;
+
+    if (from >= fm->max_cluster)
+	return 0;
+    bits = fm->bits[w] & (~(uint64_t)0 << (from % 64));
+    while (bits == 0)
+    {
+	if (++w >= fm->nwords)
+	    return 0;
+	bits = fm->bits[w];
+    }
+    start = w * 64 + __builtin_ctzll(bits);
+
+    /* the run ends at the next clear bit */
+    bits = ~fm->bits[w] & (~(uint64_t)0 << (start % 64));
+    while (bits == 0)
+    {
+	if (++w >= fm->nwords)
+	{
+	    *len = w * 64 - start;
+	    return start;
+	}
+	bits = ~fm->bits[w];
+    }
+    *len = w * 64 + __builtin_ctzll(bits) - start;
+    return start;
+}
+
+/* freemap_alloc_run allocates up to want clusters as one run, for a
+   file whose size is known.  It takes the smallest free run that holds
+   all of them, so big holes are kept for big files; if none does, it
+   takes the largest run there is, so a file that has to be split is
+   split as few times as possible.  It returns the first cluster and
+   sets *got to how many it took, or returns 0 if the volume is full. */
+uint32_t freemap_alloc_run(struct freemap *fm, uint32_t want, uint32_t *got)
+{
+    uint32_t start, len, c;
+    uint32_t best = 0, bestlen = 0, big = 0, biglen = 0;
+
+    for (start = next_free_run(fm, fm->hint * 64, &len); start != 0;
+	 start = next_free_run(fm, start + len, &len))
+    {
+	if (len >= want && (bestlen == 0 || len < bestlen))
+	{
+	    best = start;
+	    bestlen = len;
+	    if (len == want)
+		break;
+	}
+	if (len > biglen)
+	{
+	    big = start;
+	    biglen = len;
+	}
+    }
+    if (bestlen == 0)
+    {
+	best = big;
+	bestlen = biglen;
+    }
+    if (best == 0)
+    {
+	*got = 0;
+	return 0;
+    }
+
+    *got = bestlen < want ? bestlen : want;
+    for (c = best; c < best + *got; c++)
+	fm->bits[c / 64] &= ~((uint64_t)1 << (c % 64));
+    return best;
+}
+
+/* freemap_release marks a cluster free again */
+void freemap_release(struct freemap *fm, uint32_t cluster)
+{
+    if (cluster < CLUST_FIRST || cluster >= fm->max_cluster)
+	return;
+    fm->bits[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+    if (cluster / 64 < fm->hint)
+	fm->hint = cluster / 64;
+}
+
+/* freemap_is_free returns true if the map has the cluster as free */
+int freemap_is_free(struct freemap *fm, uint32_t cluster)
+{
+    if (cluster < CLUST_FIRST || cluster >= fm->max_cluster)
+	return FALSE;
+    return (fm->bits[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+/* freemap_in_use fills out with a bitset of the data clusters below
+   limit that are in use and not set in skip.  skip and out are indexed
+   like the map and hold (limit + 63) / 64 words.  It works a word at a
+   time with no branches in the loop, so the compiler can vectorise it,
+   and a caller only has to visit the bits that come out set. */
+void freemap_in_use(struct freemap *fm, const uint64_t *skip, uint64_t *out,
+		    uint32_t limit)
+{
+    uint32_t nwords, w;
+
+    if (limit > fm->max_cluster)
+	limit = fm->max_cluster;
+    nwords = (limit + 63) / 64;
+    for (w = 0; w < nwords; w++)
+	out[w] = ~fm->bits[w] & ~skip[w];
+    if (nwords == 0)
+	return;
+
+    /* clusters 0 and 1 aren't data clusters, and nothing at or past
+       limit was asked for */
+    out[0] &= ~(uint64_t)3;
+    if (limit % 64 != 0)
+	out[nwords - 1] &= ((uint64_t)1 << (limit % 64)) - 1;
+}
+
+/* freemap_free releases the map itself */
+void freemap_free(struct freemap *fm)
+{
+    free(fm->bits);
+    free(fm);
+}
+
+
+int is_valid_cluster(struct dosimage *img, uint32_t cluster)
+{
+    if (cluster >= CLUST_FIRST && cluster < img->geom.max_cluster)
         return TRUE;
     return FALSE;
 }
@@ -241,10 +1603,9 @@ int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
 
 /* is_end_of_file returns true if the FAT entry for cluster indicates
    this is the last cluster in a file */
-int is_end_of_file(uint16_t cluster) 
+int is_end_of_file(uint32_t cluster) 
 {
-    if (cluster >= (FAT12_MASK & CLUST_EOFS) && 
-        cluster <= (FAT12_MASK & CLUST_EOFE)) 
+    if (cluster >= CLUST_EOFS && cluster <= CLUST_EOFE) 
     {
 	return TRUE;
     } 
@@ -255,33 +1616,120 @@ int is_end_of_file(uint16_t cluster)
 }
 
 
+/* root_block returns the fixed root directory, or on FAT-32 the first
+   cluster of the root directory chain; cluster_block returns the
+   cluster.  write says whether the caller is going to change it. */
+static uint8_t *root_block(struct dosimage *img, int write)
+{
+    const struct dosgeom *geom = &img->geom;
+
+    if (geom->fattype == 32)
+	return img->ops->block(img, geom->root_offset, geom->clust_size,
+			       write);
+    return img->ops->block(img, geom->root_offset, 
+			   geom->data_offset - geom->root_offset, write);
+}
+
+static uint8_t *cluster_block(struct dosimage *img, uint32_t cluster,
+			      int write)
+{
+    const struct dosgeom *geom = &img->geom;
+
+    if (cluster == MSDOSFSROOT) 
+	return root_block(img, write);
+
+    /* skip the root directory, then move forward the right number of
+       clusters */
+    return img->ops->block(img, geom->data_offset 
+			   + (uint64_t)geom->clust_size * (cluster - CLUST_FIRST),
+			   geom->clust_size, write);
+}
+
+
 /* root_dir_addr returns the address in the mmapped disk image for the
-   start of the root directory, as indicated in the boot sector */
-uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
+   start of the root directory, as indicated in the boot sector.  On
+   FAT-32 that is the first cluster of the root directory chain. */
+uint8_t *root_dir_addr(struct dosimage *img)
 {
-    uint32_t offset;
-    offset = 
-	(bpb->bpbBytesPerSec 
-	 * (bpb->bpbResSectors + (bpb->bpbFATs * bpb->bpbFATsecs)));
-    return image_buf + offset;
+    return root_block(img, FALSE);
 }
 
 
 /* cluster_to_addr returns the memory location where the memory mapped
    cluster actually starts */
-uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
-			 struct bpb33* bpb)
+uint8_t *cluster_to_addr(struct dosimage *img, uint32_t cluster)
 {
-    uint8_t *p;
-    p = root_dir_addr(image_buf, bpb);
-    if (cluster != MSDOSFSROOT) 
-    {
-	/* move to the end of the root directory */
-	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
+    return cluster_block(img, cluster, FALSE);
+}
 
-	/* move forward the right number of clusters */
-	p += bpb->bpbBytesPerSec * bpb->bpbSecPerClust * (cluster - CLUST_FIRST);
-    }
-    return p;
+
+/* cluster_for_write is cluster_to_addr for a caller that is going to
+   change the directory data, so that it gets written back */
+uint8_t *cluster_for_write(struct dosimage *img, uint32_t cluster)
+{
+    return cluster_block(img, cluster, TRUE);
+}
+
+
+/* read_clusters returns count clusters of file data starting at
+   cluster.  A mapped image hands back a pointer into the mapping;
+   otherwise the data is read into buf, which must hold count
+   clusters. */
+uint8_t *read_clusters(struct dosimage *img, uint32_t cluster, uint32_t count,
+		       uint8_t *buf)
+{
+    const struct dosgeom *geom = &img->geom;
+
+    return img->ops->read(img, geom->data_offset 
+			  + (uint64_t)geom->clust_size * (cluster - CLUST_FIRST),
+			  (uint64_t)geom->clust_size * count, buf);
+}
+
+
+/* map_clusters returns a pointer to count clusters starting at
+   cluster that can be written in place, so data can go straight in
+   without a buffer.  It returns NULL unless the image is mapped for
+   writing. */
+uint8_t *map_clusters(struct dosimage *img, uint32_t cluster, uint32_t count)
+{
+    const struct dosgeom *geom = &img->geom;
+
+    if (img->buf == NULL || (img->flags & IMAGE_RDONLY) != 0)
+	return NULL;
+    return img->buf + geom->data_offset
+	+ (uint64_t)geom->clust_size * (cluster - CLUST_FIRST);
+}
+
+
+/* write_clusters stores count clusters of file data from buf,
+   starting at cluster */
+void write_clusters(struct dosimage *img, uint32_t cluster, uint32_t count,
+		    const uint8_t *buf)
+{
+    const struct dosgeom *geom = &img->geom;
+
+    img->ops->write(img, geom->data_offset 
+		    + (uint64_t)geom->clust_size * (cluster - CLUST_FIRST),
+		    (uint64_t)geom->clust_size * count, buf);
 }
 
+
+/* dirent_cluster returns the starting cluster of a directory entry;
+   FAT-32 keeps the high 16 bits in what was the EA handle */
+uint32_t dirent_cluster(struct dosimage *img, struct direntry *dirent)
+{
+    uint32_t cluster = getushort(dirent->deStartCluster);
+    if (img->geom.fattype == 32)
+	cluster |= (uint32_t)getushort(dirent->deHighClust) << 16;
+    return cluster;
+}
+
+
+/* set_dirent_cluster stores the starting cluster in a directory entry */
+void set_dirent_cluster(struct dosimage *img, struct direntry *dirent,
+			uint32_t cluster)
+{
+    putushort(dirent->deStartCluster, cluster & 0xffff);
+    if (img->geom.fattype == 32)
+	putushort(dirent->deHighClust, cluster >> 16);
+}
@@ -13,20 +13,117 @@
 
 #include <stdint.h>
 
-uint8_t *mmap_file(char *, int *);
-void unmmap_file(uint8_t *, int *);
+/* volume layout, worked out once when the image is opened.  Offsets are
+   in bytes from the start of the image; valid data clusters run from
+   CLUST_FIRST up to (but not including) max_cluster. */
+struct dosgeom {
+    int fattype;		/* 12, 16 or 32 */
+    uint32_t fatmask;		/* FAT12_MASK, FAT16_MASK or FAT32_MASK */
+    uint32_t bytes_per_sec;
+    uint32_t clust_size;	/* bytes per cluster */
+    uint32_t total_secs;
+    uint32_t fat_secs;		/* sectors per FAT */
+    uint32_t root_ents;		/* fixed root dir entries; 0 on FAT-32 */
+    uint32_t root_cluster;	/* first root dir cluster on FAT-32, else 0 */
+    uint32_t max_cluster;
+    uint64_t fat_offset;
+    uint64_t root_offset;
+    uint64_t data_offset;	/* where cluster 2 starts */
+};
 
-struct bpb33* check_bootsector(uint8_t *);
+/* an open disk image: the mapping, its size, the parsed boot sector
+   and the geometry worked out from it.  Everything below takes one of
+   these, so a process can have any number of images open at once. */
+struct dosimage;
 
-uint16_t get_fat_entry(uint16_t, uint8_t *, struct bpb33 *);
+/* flags for open_image */
+#define IMAGE_RDWR		0
+#define IMAGE_RDONLY	1	/* read-only, private, no sync on close */
+#define IMAGE_POPULATE	2	/* prefault the whole image */
+#define IMAGE_PREAD		4	/* pread/pwrite and a sector cache, not mmap;
+				   also set by DOSIMAGE_PREAD in the environment */
 
-void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+struct dosimage *open_image(char *, int);
+void close_image(struct dosimage *);
 
-int is_end_of_file(uint16_t);
-int is_valid_cluster(uint16_t, struct bpb33 *);
+const struct dosgeom *get_geometry(struct dosimage *);
+const char *image_backend(struct dosimage *);
 
-uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
+/* FAT entries are returned with the reserved, bad and EOF values
+   widened to the 32-bit CLUST_* constants in fat.h, whatever the
+   width of the FAT.  All of these go through the image's FAT cache,
+   which is written back by close_image. */
+uint32_t get_fat_entry(struct dosimage *, uint32_t);
+void get_fat_entries(struct dosimage *, uint32_t, uint32_t, uint32_t *);
 
-uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
+void set_fat_entry(struct dosimage *, uint32_t, uint32_t);
+
+/* bulk FAT-12 codecs, chosen at runtime by CPU support */
+struct fat12_codec {
+    const char *name;
+    int (*supported)(void);
+    void (*unpack)(const uint8_t *, uint16_t *, uint32_t);
+    void (*pack)(const uint16_t *, uint8_t *, uint32_t);
+};
+extern const struct fat12_codec fat12_codecs[];
+const struct fat12_codec *fat12_best_codec(void);
+void fat12_unpack(const uint8_t *, uint16_t *, uint32_t);
+void fat12_pack(const uint16_t *, uint8_t *, uint32_t);
+
+/* a cluster chain as runs of consecutive clusters */
+struct extent {
+    uint32_t start;		/* first cluster of the run */
+    uint32_t length;		/* number of clusters in the run */
+};
+
+struct extents {
+    uint32_t count;		/* number of runs */
+    uint32_t nclusters;		/* total clusters in the chain */
+    uint32_t end;		/* FAT value that ended the chain */
+    struct extent *ext;
+};
+
+struct extents *get_extents(struct dosimage *, uint32_t);
+void free_extents(struct extents *);
+void set_fat_chain(struct dosimage *, const struct extents *);
+
+struct freemap;
+struct freemap *freemap_load(struct dosimage *);
+uint32_t freemap_alloc(struct freemap *);
+uint32_t freemap_alloc_run(struct freemap *, uint32_t, uint32_t *);
+void freemap_release(struct freemap *, uint32_t);
+int freemap_is_free(struct freemap *, uint32_t);
+void freemap_in_use(struct freemap *, const uint64_t *, uint64_t *, uint32_t);
+void freemap_free(struct freemap *);
+
+int is_end_of_file(uint32_t);
+int is_valid_cluster(struct dosimage *, uint32_t);
+
+/* root_dir_addr and cluster_to_addr return directory data to read;
+   cluster_for_write returns the same for a caller that changes it in
+   place (MSDOSFSROOT for the fixed root).  Without a mapping they
+   point into the sector cache, which only writes back blocks fetched
+   with cluster_for_write.  They only stay good until enough other
+   directory blocks have been fetched to push them out, so fetch them
+   again after walking into a subdirectory. */
+uint8_t *root_dir_addr(struct dosimage *);
+
+uint8_t *cluster_to_addr(struct dosimage *, uint32_t);
+
+uint8_t *cluster_for_write(struct dosimage *, uint32_t);
+
+/* bulk file data; read_clusters may return a pointer other than its
+   buffer, which must hold all the clusters asked for.  Callers moving
+   long runs do it CLUSTER_IO_BYTES at a time.  map_clusters gives
+   clusters of a writable mapped image to fill in place, and NULL for
+   any other image. */
+#define CLUSTER_IO_BYTES (1 << 20)
+uint8_t *read_clusters(struct dosimage *, uint32_t, uint32_t, uint8_t *);
+void write_clusters(struct dosimage *, uint32_t, uint32_t, const uint8_t *);
+uint8_t *map_clusters(struct dosimage *, uint32_t, uint32_t);
+
+struct direntry;
+uint32_t dirent_cluster(struct dosimage *, struct direntry *);
+void set_dirent_cluster(struct dosimage *, struct direntry *, uint32_t);
 
 #endif // __DOS_H__
@@ -15,15 +15,15 @@
 #include "dos.h"
 
 
-uint16_t get_dirent(struct direntry *dirent, char *buffer)
+uint32_t get_dirent(struct direntry *dirent, char *buffer, struct dosimage *img)
 {
-    uint16_t followclust = 0;
+    uint32_t followclust = 0;
     memset(buffer, 0, MAXFILENAME);
 
     int i;
     char name[9];
     char extension[4];
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
@@ -77,7 +77,7 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
             strcpy(buffer, name);
-            file_cluster = getushort(dirent->deStartCluster);
+            file_cluster = dirent_cluster(img, dirent);
             followclust = file_cluster;
         }
     }
@@ -99,8 +99,8 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 }
 
 
-struct direntry *follow_dir(char *searchpath, uint16_t cluster, 
-		            uint8_t *image_buf, struct bpb33* bpb)
+struct direntry *follow_dir(char *searchpath, uint32_t cluster, 
+		            struct dosimage *img)
 {
     char *next_path_component = index(searchpath, '/');
     int entry_len = strlen(searchpath);
@@ -113,23 +113,30 @@ struct direntry *follow_dir(char *searchpath, uint16_t cluster,
 
     struct direntry *rv = NULL;
 
-    while (is_valid_cluster(cluster, bpb))
+    while (is_valid_cluster(img, cluster))
     {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(img, cluster);
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+        int numDirEntries = get_geometry(img)->clust_size / sizeof(struct direntry);
         int i = 0;
 	for ( ; i < numDirEntries; i++)
 	{
             char buffer[MAXFILENAME]; 
-            uint16_t followclust = get_dirent(dirent, buffer);
+            uint32_t followclust = get_dirent(dirent, buffer, img);
 
             if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
             {
                 if (next_path_component)
                 {
                     if (followclust)
-                        rv = follow_dir(buffer, followclust, image_buf, bpb);
+                    {
+                        rv = follow_dir(next_path_component, followclust, img);
+                        /* the subdirectory may have pushed this
+                           cluster out of the sector cache, but
+                           fetching it again could push out rv */
+                        if (!rv)
+                            dirent = (struct direntry*)cluster_to_addr(img, cluster) + i;
+                    }
                 }
                 else
                 {
@@ -143,19 +150,26 @@ struct direntry *follow_dir(char *searchpath, uint16_t cluster,
             dirent++;
 	}
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+	cluster = get_fat_entry(img, cluster);
     }
 
     return rv;
 }
 
 
-struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb33* bpb)
+struct direntry *traverse_root(char *searchpath, struct dosimage *img)
 {
     uint16_t cluster = 0;
     struct direntry *rv = NULL;
+    const struct dosgeom *geom = get_geometry(img);
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    if (geom->fattype == 32)
+    {
+        /* FAT-32 has no fixed root directory, just a cluster chain */
+        return follow_dir(searchpath, geom->root_cluster, img);
+    }
+
+    struct direntry *dirent = (struct direntry*)cluster_to_addr(img, cluster);
 
     char *next_path_component = index(searchpath, '/');
     int root_entry_len = strlen(searchpath);
@@ -169,16 +183,20 @@ struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb3
     char buffer[MAXFILENAME];
 
     int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    for ( ; i < geom->root_ents; i++)
     {
-        uint16_t followclust = get_dirent(dirent, buffer);
+        uint32_t followclust = get_dirent(dirent, buffer, img);
 
         if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
         {
             if (!next_path_component)
                 rv = dirent;
-            else if (is_valid_cluster(followclust, bpb))
-                rv = follow_dir(next_path_component, followclust, image_buf, bpb);
+            else if (is_valid_cluster(img, followclust))
+            {
+                rv = follow_dir(next_path_component, followclust, img);
+                if (!rv)
+                    dirent = (struct direntry*)cluster_to_addr(img, cluster) + i;
+            }
         }
 
         if (rv)
@@ -191,37 +209,60 @@ struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb3
 }
 
 
-struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *bpb)
+struct direntry *find_file(char *searchpath, struct dosimage *img)
 {
     /* strip any leading '/' from search path */
     while (*searchpath == '/' && *searchpath != '\0') searchpath++;
-    return traverse_root(searchpath, image_buf, bpb);
+    return traverse_root(searchpath, img);
 }
 
 
-void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+void do_cat(struct direntry *dirent, struct dosimage *img)
 {
-    uint16_t cluster = getushort(dirent->deStartCluster);
+    uint32_t cluster = dirent_cluster(img, dirent);
     uint32_t bytes_remaining = getulong(dirent->deFileSize);
-    uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t cluster_size = get_geometry(img)->clust_size;
 
     char buffer[MAXFILENAME];
-    get_dirent(dirent, buffer);
+    get_dirent(dirent, buffer, img);
 
     fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
 
-    while (is_valid_cluster(cluster, bpb))
+    /* write each run of consecutive clusters in as few pieces as the
+       buffer allows; a mapped image hands the data back without
+       using it */
+    uint32_t chunk = CLUSTER_IO_BYTES / cluster_size;
+    if (chunk == 0)
+        chunk = 1;
+    uint8_t *buf = malloc((uint64_t)chunk * cluster_size);
+    struct extents *ex = get_extents(img, cluster);
+    int i = 0;
+    for ( ; i < ex->count && bytes_remaining > 0; i++)
     {
-        /* map the cluster number to the data location */
-        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
-
-        uint32_t nbytes = bytes_remaining > cluster_size ? cluster_size : bytes_remaining;
-
-        fwrite(p, 1, nbytes, stdout);
-        bytes_remaining -= nbytes;
-    
-        cluster = get_fat_entry(cluster, image_buf, bpb);
+        uint32_t start = ex->ext[i].start;
+        uint32_t left = ex->ext[i].length;
+        while (left > 0 && bytes_remaining > 0)
+        {
+            /* don't read clusters past the end of the file */
+            uint32_t n = (bytes_remaining + cluster_size - 1) / cluster_size;
+            if (n > left)
+                n = left;
+            if (n > chunk)
+                n = chunk;
+            uint8_t *p = read_clusters(img, start, n, buf);
+
+            uint64_t runbytes = (uint64_t)n * cluster_size;
+            uint32_t nbytes = bytes_remaining > runbytes ? runbytes : bytes_remaining;
+
+            fwrite(p, 1, nbytes, stdout);
+            bytes_remaining -= nbytes;
+            start += n;
+            left -= n;
+        }
     }
+
+    free_extents(ex);
+    free(buf);
 }
 
 
@@ -234,22 +275,23 @@ void usage(char *progname)
 
 int main(int argc, char** argv)
 {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
+    struct dosimage *img;
     if (argc != 3)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
+    img = open_image(argv[1], IMAGE_RDONLY);
+    if (img == NULL)
+    {
+	exit(1);
+    }
 
-    struct direntry *dirent = find_file(argv[2], image_buf, bpb);
+    struct direntry *dirent = find_file(argv[2], img);
     if (dirent)
-        do_cat(dirent, image_buf, bpb);
+        do_cat(dirent, img);
 
-    unmmap_file(image_buf, &fd);
+    close_image(img);
 
     return 0;
 }
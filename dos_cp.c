@@ -1,3 +1,4 @@
+#define _GNU_SOURCE		/* for vmsplice */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -6,9 +7,12 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -60,261 +64,271 @@ void get_name(char *fullname, struct direntry *dirent)
 }
 
 
-/* find_file seeks through the directories in the memory disk image,
-   until it finds the named file */
+/* pieces of a file gathered up for one writev */
+#define OUT_PIECES 64
 
-/* flags, depending on whether we're searching for a file or a
-   directory */
-#define FIND_FILE 0
-#define FIND_DIR 1
+/* write_pieces writes out n pieces, picking up after short writes.
+   Pieces that point into the image's mapping can go to a pipe with
+   vmsplice, which hands the pipe the pages rather than copying them. */
 
-struct direntry* find_file(char *infilename, uint16_t cluster,
-			   int find_mode,
-			   uint8_t *image_buf, struct bpb33* bpb)
+int write_pieces(int fd, struct iovec *iov, int n, int use_splice)
 {
-    char buf[MAXPATHLEN];
-    char *seek_name, *next_name;
-    int d;
-    struct direntry *dirent;
-    uint16_t dir_cluster;
-    char fullname[13];
-
-    /* find the first dirent in this directory */
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    /* first we need to split the file name we're looking for into the
-       first part of the path, and the remainder.  We hunt through the
-       current directory for the first part.  If there's a remainder,
-       and what we find is a directory, then we recurse, and search
-       that directory for the remainder */
+    ssize_t done;
 
-    strncpy(buf, infilename, MAXPATHLEN);
-    seek_name = buf;
-
-    /* trim leading slashes */
-    while (*seek_name == '/' || *seek_name == '\\') 
+    while (n > 0)
     {
-	seek_name++;
-    }
+	if (use_splice)
+	    done = vmsplice(fd, iov, n, 0);
+	else
+	    done = writev(fd, iov, n);
+	if (done < 0 && errno == EINTR)
+	    continue;
+	if (done < 0 && use_splice)
+	{
+	    /* not every kernel or pipe takes it */
+	    use_splice = 0;
+	    continue;
+	}
+	if (done <= 0)
+	    return -1;
 
-    /* search for any more slashes - if so, it's a dirname */
-    next_name = seek_name;
-    while (1) 
-    {
-	if (*next_name == '/' || *next_name == '\\') 
+	/* step over what went out */
+	while (n > 0 && (size_t)done >= iov->iov_len)
 	{
-	    *next_name = '\0';
-	    next_name ++;
-	    break;
+	    done -= iov->iov_len;
+	    iov++;
+	    n--;
 	}
-	if (*next_name == '\0') 
+	if (n > 0)
 	{
-	    /* end of name - no slashes found */
-	    next_name = NULL;
-	    if (find_mode == FIND_DIR) 
-	    {
-		return dirent;
-	    }
-	    break;
+	    iov->iov_base = (uint8_t *)iov->iov_base + done;
+	    iov->iov_len -= done;
 	}
-	next_name++;
     }
+    return 0;
+}
+
+/* copy_out_file actually does the work of copying.  It turns the
+   file's cluster chain into runs of consecutive clusters, and writes
+   them out of the disk image with as few system calls as it can.  A
+   mapped image hands back pointers into the mapping, which stay good,
+   so the runs are gathered up and written together; otherwise each
+   piece is read into the buffer and written before the buffer is used
+   again.  Returns -1 if the output couldn't be written. */
 
-    while (1) 
+int copy_out_file(int fd, uint32_t cluster, uint32_t bytes_remaining,
+		  struct dosimage *img)
+{
+    uint32_t clust_size, chunk, start, left, n, i;
+    uint64_t run_bytes;
+    struct extents *ex;
+    struct iovec iov[OUT_PIECES];
+    struct stat st;
+    uint8_t *buf, *p;
+    int npieces = 0, is_pipe, status = 0;
+
+    is_pipe = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    clust_size = get_geometry(img)->clust_size;
+    chunk = CLUSTER_IO_BYTES / clust_size;
+    if (chunk == 0)
+    {
+	chunk = 1;
+    }
+    buf = malloc((uint64_t)chunk * clust_size);
+    ex = get_extents(img, cluster);
+
+    for (i = 0; i < ex->count && bytes_remaining > 0 && status == 0; i++) 
     {
-	/* hunt a cluster for the relevant dirent.  If we reach the
-	   end of the cluster, we'll need to go to the next cluster
-	   for this directory */
-	for (d = 0; 
-	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
-	     d += sizeof(struct direntry)) 
+	start = ex->ext[i].start;
+	left = ex->ext[i].length;
+	while (left > 0 && bytes_remaining > 0 && status == 0)
 	{
-	    if (dirent->deName[0] == SLOT_EMPTY) 
+	    /* read no further than the end of the file */
+	    n = (bytes_remaining + clust_size - 1) / clust_size;
+	    if (n > left)
 	    {
-		/* we failed to find the file */
-		return NULL;
+		n = left;
 	    }
-
-	    if (dirent->deName[0] == SLOT_DELETED) 
+	    if (n > chunk)
 	    {
-		/* skip over a deleted file */
-		dirent++;
-		continue;
+		n = chunk;
 	    }
-
-	    get_name(fullname, dirent);
-	    if (strcmp(fullname, seek_name)==0) 
+	    p = read_clusters(img, start, n, buf);
+	    run_bytes = (uint64_t)n * clust_size;
+	    if (run_bytes > bytes_remaining)
 	    {
-		/* found it! */
-		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-		{
-		    /* it's a directory */
-		    if (next_name == NULL) 
-		    {
-			fprintf(stderr, "Cannot copy out a directory\n");
-			exit(1);
-		    }
-		    dir_cluster = getushort(dirent->deStartCluster);
-		    return find_file(next_name, dir_cluster, 
-				     find_mode, image_buf, bpb);
-		} 
-		else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
-		{
-		    /* it's a volume */
-		    fprintf(stderr, "Cannot copy out a volume\n");
-		    exit(1);
-		} 
-		else 
-		{
-		    /* assume it's a file */
-		    return dirent;
-		}
+		/* this is the last piece */
+		run_bytes = bytes_remaining;
+	    }
+	    iov[npieces].iov_base = p;
+	    iov[npieces].iov_len = run_bytes;
+	    npieces++;
+	    bytes_remaining -= run_bytes;
+	    start += n;
+	    left -= n;
+
+	    if (p == buf)
+	    {
+		/* the buffer is needed for the next piece */
+		status = write_pieces(fd, iov, npieces, FALSE);
+		npieces = 0;
+	    }
+	    else if (npieces == OUT_PIECES)
+	    {
+		status = write_pieces(fd, iov, npieces, is_pipe);
+		npieces = 0;
 	    }
-	    dirent++;
 	}
+    }
+    if (npieces > 0 && status == 0)
+    {
+	status = write_pieces(fd, iov, npieces, is_pipe);
+    }
+    free(buf);
 
-	/* we've reached the end of the cluster for this directory.
-	   Where's the next cluster? */
-	if (cluster == 0) 
-	{
-	    // root dir is special
-	    dirent++;
-	} 
-	else 
-	{
-	    cluster = get_fat_entry(cluster, image_buf, bpb);
-	    dirent = (struct direntry*)cluster_to_addr(cluster, 
-						       image_buf, bpb);
-	}
+    /* running out of chain early is only fine if it ended properly */
+    if ((bytes_remaining > 0 || ex->count == 0) && !is_end_of_file(ex->end)) 
+    {
+	fprintf(stderr, "Bad file termination\n");
     }
+    free_extents(ex);
+    return status;
 }
 
+/* read_full reads up to len bytes, stopping early only at end of
+   file, and returns how many it got, or -1 on an error */
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
-
-void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
-		   uint8_t *image_buf, struct bpb33* bpb)
+ssize_t read_full(int fd, uint8_t *p, size_t len)
 {
-    int total_clusters, clust_size;
-    uint8_t *p;
-
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    ssize_t n;
+    size_t got = 0;
 
-    assert(cluster <= total_clusters);
-
-    if (cluster == 0) 
+    while (got < len)
     {
-	fprintf(stderr, "Bad file termination\n");
-	return;
+	n = read(fd, p + got, len - got);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return -1;
+	if (n == 0)
+	    break;
+	got += n;
     }
-    else if (is_end_of_file(cluster)) 
-    {
-	return;	
-    } 
-
+    return got;
+}
 
-    /* map the cluster number to the data location */
-    p = cluster_to_addr(cluster, image_buf, bpb);
+/* reserve_clusters takes n clusters from the free map as runs of
+   consecutive clusters, or returns NULL, having taken none, if there
+   aren't enough.  The whole file goes in one run if any hole is big
+   enough, and otherwise in as few runs as there can be. */
 
-    if (bytes_remaining <= clust_size) 
-    {
-	/* this is the last cluster */
-	fwrite(p, bytes_remaining, 1, fd);
-    } 
-    else 
+struct extents *reserve_clusters(struct freemap *fm, uint32_t n)
+{
+    struct extents *ex;
+    uint32_t c, len, cap = 4, i, j;
+
+    ex = malloc(sizeof(struct extents));
+    ex->count = 0;
+    ex->nclusters = 0;
+    ex->end = CLUST_EOFS;
+    ex->ext = malloc(cap * sizeof(struct extent));
+    while (ex->nclusters < n)
     {
-	/* more clusters after this one */
-	fwrite(p, clust_size, 1, fd);
-
-	/* recurse, continuing to copy */
-	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
-		      bytes_remaining - clust_size, image_buf, bpb);
+	c = freemap_alloc_run(fm, n - ex->nclusters, &len);
+	if (c == 0)
+	{
+	    for (i = 0; i < ex->count; i++)
+		for (j = 0; j < ex->ext[i].length; j++)
+		    freemap_release(fm, ex->ext[i].start + j);
+	    free_extents(ex);
+	    return NULL;
+	}
+	if (ex->count == cap)
+	{
+	    cap *= 2;
+	    ex->ext = realloc(ex->ext, cap * sizeof(struct extent));
+	}
+	ex->ext[ex->count].start = c;
+	ex->ext[ex->count].length = len;
+	ex->count++;
+	ex->nclusters += len;
     }
-    return;
+    return ex;
 }
 
-/* copyout copies a file from the FAT-12 memory disk image to a
-   regular file in the file system */
+/* trim_extents cuts a reserved chain down to its first n clusters,
+   and gives the rest back to the free map */
 
-void copyout(char *infilename, char* outfilename,
-	     uint8_t *image_buf, struct bpb33* bpb)
+void trim_extents(struct extents *ex, uint32_t n, struct freemap *fm)
 {
-    struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
-    uint32_t size;
+    uint32_t i, j, keep;
 
-    /* skip the volume name */
-    assert(strncmp("a:", infilename, 2)==0);
-    infilename+=2;
-
-    /* find the dirent of the file in the memory disk image */
-    dirent = find_file(infilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent == NULL) 
+    for (i = 0; i < ex->count; i++)
     {
-	fprintf(stderr, "No file called %s exists in the disk image\n",
-		infilename);
-	exit(1);
+	keep = n < ex->ext[i].length ? n : ex->ext[i].length;
+	for (j = keep; j < ex->ext[i].length; j++)
+	    freemap_release(fm, ex->ext[i].start + j);
+	ex->ext[i].length = keep;
+	n -= keep;
     }
+    while (ex->count > 0 && ex->ext[ex->count-1].length == 0)
+	ex->count--;
+}
 
-    /* open the real file for writing */
-    fd = fopen(outfilename, "w");
-    if (fd == NULL) 
+/* free_chain frees a chain of clusters again, in the FAT and the free
+   map */
+
+void free_chain(struct dosimage *img, struct freemap *fm, uint32_t start)
+{
+    struct extents *ex = get_extents(img, start);
+    uint32_t i, c;
+
+    for (i = 0; i < ex->count; i++)
     {
-	fprintf(stderr, "Can't open file %s to copy data out\n",
-		outfilename);
-	exit(1);
+	for (c = ex->ext[i].start; c < ex->ext[i].start + ex->ext[i].length; c++)
+	{
+	    set_fat_entry(img, c, CLUST_FREE);
+	    freemap_release(fm, c);
+	}
     }
-
-    /* do the actual copy out*/
-    start_cluster = getushort(dirent->deStartCluster);
-    size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
-    
-    fclose(fd);
+    free_extents(ex);
 }
 
-/* copy_in_file actually does the copying of the file into the memory
-   image, updates the FAT, and returns the starting cluster of the
-   file */
+/* copy_in_stream copies in a file whose size isn't known up front, a
+   pipe say, a cluster at a time */
 
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
-		      uint32_t *size)
+int copy_in_stream(int fd, struct dosimage *img, struct freemap *fm,
+		   uint32_t *start, uint32_t *size)
 {
-    uint32_t clust_size, total_clusters, i;
+    uint32_t clust_size, i;
     uint8_t *buf;
-    size_t bytes;
-    uint16_t start_cluster = 0;
-    uint16_t prev_cluster = 0;
+    ssize_t bytes;
+    uint32_t start_cluster = 0;
+    uint32_t prev_cluster = 0;
     
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    clust_size = get_geometry(img)->clust_size;
     buf = malloc(clust_size);
     while(1) 
     {
 	/* read a block of data, and store it */
-	bytes = fread(buf, 1, clust_size, fd);
+	bytes = read_full(fd, buf, clust_size);
+	if (bytes < 0)
+	{
+	    fprintf(stderr, "Can't read file to copy in: %s\n",
+		    strerror(errno));
+	    break;
+	}
 	if (bytes > 0) {
 	    *size += bytes;
 
 	    /* find a free cluster */
-	    for (i = 2; i < total_clusters; i++) 
-	    {
-		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
-		{
-		    break;
-		}
-	    }
-
-	    if (i == total_clusters) 
+	    i = freemap_alloc(fm);
+	    if (i == 0) 
 	    {
 		/* oops - we ran out of disk space */
 		fprintf(stderr, "No more space in filesystem\n");
-		/* we should clean up here, rather than just exit */ 
-		exit(1);
+		bytes = -1;
+		break;
 	    }
 
 	    /* remember the first cluster, as we need to store this in
@@ -327,32 +341,167 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
 	    {
 		/* link the previous cluster to this one in the FAT */
 		assert(prev_cluster != 0);
-		set_fat_entry(prev_cluster, i, image_buf, bpb);
+		set_fat_entry(img, prev_cluster, i);
 	    }
 
 	    /* make sure we've recorded this cluster as used */
-	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+	    set_fat_entry(img, i, CLUST_EOFS);
 
 	    /* copy the data into the cluster */
-	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
+	    memset(buf + bytes, 0, clust_size - bytes);
+	    write_clusters(img, i, 1, buf);
 	}
 
 	if (bytes < clust_size) 
 	{
-	    /* We didn't real a full cluster, so we either got a read
-	       error, or reached end of file.  We exit anyway */
+	    /* We didn't read a full cluster, so we reached end of
+	       file */
 	    break;
 	}
 	prev_cluster = i;
     }
 
     free(buf);
-    return start_cluster;
+    if (bytes < 0)
+    {
+	/* give back what it got */
+	if (start_cluster != 0)
+	{
+	    free_chain(img, fm, start_cluster);
+	}
+	return -1;
+    }
+    *start = start_cluster;
+    return 0;
+}
+
+/* fill_clusters reads up to size bytes of fd into the clusters of a
+   reservation: on a mapped image straight into them, and otherwise
+   through a buffer CLUSTER_IO_BYTES at a time.  Whatever the file
+   doesn't fill is zeroed.  Returns how many bytes it read, or -1 if
+   the file couldn't be read. */
+
+int64_t fill_clusters(int fd, struct dosimage *img, struct extents *ex,
+		      uint64_t size)
+{
+    uint32_t clust_size, chunk, start, left, n, i;
+    uint64_t want, remaining = size, total = 0;
+    uint8_t *buf = NULL, *p;
+    ssize_t got;
+
+    clust_size = get_geometry(img)->clust_size;
+    chunk = CLUSTER_IO_BYTES / clust_size;
+    if (chunk == 0)
+    {
+	chunk = 1;
+    }
+
+    for (i = 0; i < ex->count; i++)
+    {
+	start = ex->ext[i].start;
+	left = ex->ext[i].length;
+	while (left > 0)
+	{
+	    n = left < chunk ? left : chunk;
+	    want = (uint64_t)n * clust_size;
+	    if (want > remaining)
+	    {
+		want = remaining;
+	    }
+	    p = map_clusters(img, start, n);
+	    if (p == NULL)
+	    {
+		if (buf == NULL)
+		{
+		    buf = malloc((uint64_t)chunk * clust_size);
+		}
+		p = buf;
+	    }
+	    got = want > 0 ? read_full(fd, p, want) : 0;
+	    if (got < 0)
+	    {
+		free(buf);
+		return -1;
+	    }
+
+	    /* the end of the last cluster is zeroed */
+	    memset(p + got, 0, (uint64_t)n * clust_size - got);
+	    if (p == buf)
+	    {
+		write_clusters(img, start, n, buf);
+	    }
+	    total += got;
+	    remaining = got < want ? 0 : remaining - want;
+	    start += n;
+	    left -= n;
+	}
+    }
+    free(buf);
+    return total;
 }
 
-/* write the values into a directory entry */
+/* copy_in_file actually does the copying of the file into the memory
+   image, updates the FAT, and returns the starting cluster of the
+   file.  Clusters come from the free map, which is kept in step with
+   the FAT.  A regular file's size is known, so every cluster it needs
+   is reserved before any data is read, and the FAT chain is written
+   once the data is in.  Returns -1, having said why and changed
+   nothing, if it can't. */
+
+int copy_in_file(int fd, struct dosimage *img, struct freemap *fm,
+		 uint32_t *start, uint32_t *size)
+{
+    struct stat st;
+    struct extents *ex;
+    uint32_t clust_size;
+    int64_t total;
+
+    *start = 0;
+    *size = 0;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+	return copy_in_stream(fd, img, fm, start, size);
+    }
+    if ((uint64_t)st.st_size > UINT32_MAX)
+    {
+	fprintf(stderr, "File is too big for a FAT filesystem\n");
+	return -1;
+    }
+    if (st.st_size == 0)
+    {
+	return 0;
+    }
+
+    clust_size = get_geometry(img)->clust_size;
+    ex = reserve_clusters(fm, (st.st_size + clust_size - 1) / clust_size);
+    if (ex == NULL)
+    {
+	fprintf(stderr, "No more space in filesystem\n");
+	return -1;
+    }
+    total = fill_clusters(fd, img, ex, st.st_size);
+    if (total < 0)
+    {
+	fprintf(stderr, "Can't read file to copy in: %s\n", strerror(errno));
+	trim_extents(ex, 0, fm);
+	free_extents(ex);
+	return -1;
+    }
+
+    /* the file may have shrunk since it was measured */
+    trim_extents(ex, (total + clust_size - 1) / clust_size, fm);
+    set_fat_chain(img, ex);
+    *start = ex->count > 0 ? ex->ext[0].start : 0;
+    free_extents(ex);
+    *size = total;
+    return 0;
+}
+
+/* write the values into a directory entry; a directory's name needn't
+   have an extension */
 void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
+		  uint32_t start_cluster, uint32_t size, uint8_t attr,
+		  struct dosimage *img)
 {
     char *p, *p2;
     char *uppername;
@@ -382,7 +531,11 @@ void write_dirent(struct direntry *dirent, char *filename,
     memset(dirent->deName, ' ', 8);
     p = strchr(uppername, '.');
     memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
+    if (p == NULL && attr == ATTR_DIRECTORY)
+    {
+	memset(dirent->deExtension, ' ', 3);
+    }
+    else if (p == NULL) 
     {
 	fprintf(stderr, "No filename extension given - defaulting to .___\n");
     }
@@ -403,8 +556,8 @@ void write_dirent(struct direntry *dirent, char *filename,
     free(p2);
 
     /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
+    dirent->deAttributes = attr;
+    set_dirent_cluster(img, dirent, start_cluster);
     putulong(dirent->deFileSize, size);
 
     /* could also set time and date here if we really
@@ -412,84 +565,917 @@ void write_dirent(struct direntry *dirent, char *filename,
 }
 
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
+/* Copying a whole tree (-r) takes two passes.  The first walks the
+   tree once, on this thread, and does everything that touches the
+   image's metadata: copying in, it makes the directories, reserves
+   each file's clusters and writes its FAT chain and directory entry;
+   copying out, it makes the real directories.  What's left is a list
+   of files whose data still has to move, each between clusters and a
+   real file that nothing else uses, so the second pass can share the
+   list out among worker threads with no locking but the counter that
+   hands out the next file.  A file that shrank while its data was
+   copied in is put right on this thread again, once the workers are
+   done. */
+
+struct copyjob {
+    char *path;			/* the real file */
+    uint32_t cluster;		/* where the file starts in the image */
+    uint32_t size;
+    struct extents *ex;		/* the clusters reserved for it (copy in) */
+    uint32_t dir;		/* the directory it went into (copy in) */
+    uint32_t got;		/* the bytes that were copied in */
+};
+
+struct copyjobs {
+    struct dosimage *img;
+    int copy_in;
+    struct copyjob *jobs;
+    int count, max;
+    int next;			/* the next job to hand out */
+    int failed;
+    int full;			/* the volume filled up, so stop */
+};
+
+static void add_job(struct copyjobs *jobs, char *path, uint32_t cluster,
+		    uint32_t size, struct extents *ex, uint32_t dir)
+{
+    if (jobs->count == jobs->max)
+    {
+	jobs->max = jobs->max ? 2 * jobs->max : 64;
+	jobs->jobs = realloc(jobs->jobs, jobs->max * sizeof(struct copyjob));
+    }
+    jobs->jobs[jobs->count].path = strdup(path);
+    jobs->jobs[jobs->count].cluster = cluster;
+    jobs->jobs[jobs->count].size = size;
+    jobs->jobs[jobs->count].ex = ex;
+    jobs->jobs[jobs->count].dir = dir;
+    jobs->jobs[jobs->count].got = size;
+    jobs->count++;
+}
+
+static void job_failed(struct copyjobs *jobs)
+{
+    __atomic_store_n(&jobs->failed, 1, __ATOMIC_RELAXED);
+}
+
+/* a walk over the slots of a directory in the image, a block at a
+   time: the fixed root is one block, and any other directory one
+   block per cluster */
+struct dirwalk {
+    struct dosimage *img;
+    uint32_t cluster;		/* the block being walked */
+    uint32_t last;		/* the last block that was there */
+    uint32_t slot, nslots;
+    uint32_t blocks;		/* counted, so a chain that loops ends */
+};
+
+static void dirwalk_start(struct dirwalk *w, struct dosimage *img,
+			  uint32_t dir)
+{
+    const struct dosgeom *geom = get_geometry(img);
+
+    /* FAT-32 has no fixed root directory, just a cluster chain */
+    if (dir == MSDOSFSROOT && geom->fattype == 32)
+    {
+	dir = geom->root_cluster;
+    }
+    w->img = img;
+    w->cluster = dir;
+    w->last = dir;
+    w->slot = 0;
+    if (dir == MSDOSFSROOT)
+    {
+	w->nslots = geom->root_ents;
+    }
+    else
+    {
+	w->nslots = geom->clust_size / sizeof(struct direntry);
+    }
+    w->blocks = 0;
+}
+
+/* dirwalk_next returns the next slot, or NULL at the end of the
+   directory.  The block is fetched again for every slot, so a walk
+   can go on after walking into a subdirectory, but each pointer only
+   stays good until the next block is fetched. */
+static struct direntry *dirwalk_next(struct dirwalk *w)
+{
+    if (w->slot == w->nslots)
+    {
+	if (w->cluster == MSDOSFSROOT
+	    || ++w->blocks >= get_geometry(w->img)->max_cluster)
+	{
+	    return NULL;
+	}
+	w->cluster = get_fat_entry(w->img, w->cluster);
+	w->slot = 0;
+    }
+    if (w->cluster != MSDOSFSROOT && !is_valid_cluster(w->img, w->cluster))
+    {
+	return NULL;
+    }
+    w->last = w->cluster;
+    return (struct direntry*)cluster_to_addr(w->img, w->cluster) + w->slot++;
+}
+
+/* dirwalk_write returns the slot dirwalk_next last returned again, for
+   changing */
+static struct direntry *dirwalk_write(struct dirwalk *w)
+{
+    return (struct direntry*)cluster_for_write(w->img, w->last) + w->slot - 1;
+}
+
+/* is_listed returns true if a slot holds a file or directory */
+static int is_listed(struct direntry *dirent)
+{
+    return dirent->deName[0] != SLOT_EMPTY
+	&& dirent->deName[0] != SLOT_DELETED
+	&& dirent->deName[0] != '.'
+	&& (dirent->deAttributes & ATTR_WIN95LFN) != ATTR_WIN95LFN
+	&& (dirent->deAttributes & ATTR_VOLUME) == 0;
+}
+
+/* find_slot walks the directory dir with w until it finds the entry
+   called name, and returns it, or NULL */
+static struct direntry *find_slot(struct dirwalk *w, struct dosimage *img,
+				  uint32_t dir, char *name)
+{
+    struct direntry *dirent;
+    char fullname[13];
+
+    dirwalk_start(w, img, dir);
+    while ((dirent = dirwalk_next(w)) != NULL)
+    {
+	if (dirent->deName[0] == SLOT_EMPTY)
+	{
+	    break;
+	}
+	if (!is_listed(dirent))
+	{
+	    continue;
+	}
+	get_name(fullname, dirent);
+	if (strcasecmp(fullname, name) == 0)
+	{
+	    return dirent;
+	}
+    }
+    return NULL;
+}
+
+/* find_entry returns the entry called name in the directory dir, or
+   NULL */
+static struct direntry *find_entry(struct dosimage *img, uint32_t dir,
+				   char *name)
+{
+    struct dirwalk w;
+
+    return find_slot(&w, img, dir, name);
+}
+
+static void zero_cluster(struct dosimage *img, uint32_t cluster)
+{
+    uint32_t clust_size = get_geometry(img)->clust_size;
+    uint8_t *p = map_clusters(img, cluster, 1);
+
+    if (p != NULL)
+    {
+	memset(p, 0, clust_size);
+	return;
+    }
+    p = calloc(1, clust_size);
+    write_clusters(img, cluster, 1, p);
+    free(p);
+}
 
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+/* add_entry copies entry into the first free slot of the directory
+   dir, giving the directory another cluster if it is full.  Returns
+   FALSE if there's no room: the fixed root is full, or the volume. */
+static int add_entry(struct dosimage *img, struct freemap *fm, uint32_t dir,
+		     struct direntry *entry)
 {
-    while (1) 
+    struct dirwalk w;
+    struct direntry *dirent;
+    uint32_t cluster;
+    int was_empty;
+
+    dirwalk_start(&w, img, dir);
+    while ((dirent = dirwalk_next(&w)) != NULL)
     {
-	if (dirent->deName[0] == SLOT_EMPTY) 
+	if (dirent->deName[0] == SLOT_EMPTY || dirent->deName[0] == SLOT_DELETED)
 	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
+	    was_empty = dirent->deName[0] == SLOT_EMPTY;
+	    memcpy(dirwalk_write(&w), entry, sizeof(struct direntry));
 
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
+	    /* make sure the directory still ends after it, just in case
+	       it didn't before */
+	    if (was_empty && dirwalk_next(&w) != NULL)
+	    {
+		memset(dirwalk_write(&w), 0, sizeof(struct direntry));
+	    }
+	    return TRUE;
 	}
+    }
+
+    if (w.last == MSDOSFSROOT || (cluster = freemap_alloc(fm)) == 0)
+    {
+	return FALSE;
+    }
+    zero_cluster(img, cluster);
+    set_fat_entry(img, w.last, cluster);
+    set_fat_entry(img, cluster, CLUST_EOFS);
+    memcpy(cluster_for_write(img, cluster), entry, sizeof(struct direntry));
+    return TRUE;
+}
 
-	if (dirent->deName[0] == SLOT_DELETED) 
+/* make_dir makes an empty directory called name in dir, and returns
+   its cluster, or 0 if there's no room for it */
+static uint32_t make_dir(struct dosimage *img, struct freemap *fm, uint32_t dir,
+			 char *name)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    struct direntry entry, *dots;
+    uint32_t cluster;
+
+    cluster = freemap_alloc(fm);
+    if (cluster == 0)
+    {
+	return 0;
+    }
+    set_fat_entry(img, cluster, CLUST_EOFS);
+    zero_cluster(img, cluster);
+
+    /* "." and "..", where ".." in a directory in the root is 0 */
+    if (geom->fattype == 32 && dir == geom->root_cluster)
+    {
+	dir = MSDOSFSROOT;
+    }
+    dots = (struct direntry*)cluster_for_write(img, cluster);
+    memset(dots[0].deName, ' ', 8);
+    memset(dots[0].deExtension, ' ', 3);
+    dots[0].deName[0] = '.';
+    dots[0].deAttributes = ATTR_DIRECTORY;
+    set_dirent_cluster(img, &dots[0], cluster);
+    memcpy(&dots[1], &dots[0], sizeof(struct direntry));
+    dots[1].deName[1] = '.';
+    set_dirent_cluster(img, &dots[1], dir);
+
+    write_dirent(&entry, name, cluster, 0, ATTR_DIRECTORY, img);
+    if (!add_entry(img, fm, dir, &entry))
+    {
+	set_fat_entry(img, cluster, CLUST_FREE);
+	freemap_release(fm, cluster);
+	return 0;
+    }
+    return cluster;
+}
+
+/* image_dir finds the directory at path in the image, making any of
+   it that isn't there yet unless fm is NULL.  Returns FALSE, having
+   said why, if it can't. */
+static int image_dir(struct dosimage *img, struct freemap *fm, char *path,
+		     uint32_t *cluster)
+{
+    struct direntry entry, *dirent;
+    char buf[MAXPATHLEN], fullname[13];
+    char *name, *rest;
+    uint32_t dir = MSDOSFSROOT;
+
+    strncpy(buf, path, MAXPATHLEN - 1);
+    buf[MAXPATHLEN - 1] = '\0';
+    for (name = strtok_r(buf, "/\\", &rest); name != NULL;
+	 name = strtok_r(NULL, "/\\", &rest))
+    {
+	write_dirent(&entry, name, 0, 0, ATTR_DIRECTORY, img);
+	get_name(fullname, &entry);
+	dirent = find_entry(img, dir, fullname);
+	if (dirent != NULL && (dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	{
+	    dir = dirent_cluster(img, dirent);
+	    continue;
+	}
+	if (dirent != NULL || fm == NULL)
 	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
+	    fprintf(stderr, "No directory %s exists in the disk image\n", path);
+	    return FALSE;
+	}
+	dir = make_dir(img, fm, dir, name);
+	if (dir == 0)
+	{
+	    fprintf(stderr, "No more space in filesystem\n");
+	    return FALSE;
 	}
-	dirent++;
     }
+    *cluster = dir;
+    return TRUE;
+}
+
+/* tree_in walks the real directory path, and copies what's in it into
+   the directory dir in the image */
+static void tree_in(struct copyjobs *jobs, struct freemap *fm, char *path,
+		    uint32_t dir)
+{
+    struct dosimage *img = jobs->img;
+    uint32_t clust_size = get_geometry(img)->clust_size;
+    struct direntry entry, *dirent;
+    struct extents *ex;
+    struct dirent *de;
+    struct stat st;
+    char sub[MAXPATHLEN], fullname[13];
+    uint32_t cluster;
+    DIR *dp;
+
+    dp = opendir(path);
+    if (dp == NULL)
+    {
+	fprintf(stderr, "Can't read directory %s: %s\n", path, strerror(errno));
+	job_failed(jobs);
+	return;
+    }
+    while (!jobs->full && (de = readdir(dp)) != NULL)
+    {
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	{
+	    continue;
+	}
+	if (snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name) >= sizeof(sub)
+	    || stat(sub, &st) != 0)
+	{
+	    fprintf(stderr, "Can't copy %s/%s\n", path, de->d_name);
+	    job_failed(jobs);
+	    continue;
+	}
+
+	if (S_ISDIR(st.st_mode))
+	{
+	    write_dirent(&entry, de->d_name, 0, 0, ATTR_DIRECTORY, img);
+	    get_name(fullname, &entry);
+	    dirent = find_entry(img, dir, fullname);
+	    if (dirent != NULL && (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    {
+		fprintf(stderr, "File %s already exists\n", sub);
+		job_failed(jobs);
+		continue;
+	    }
+	    if (dirent != NULL)
+	    {
+		cluster = dirent_cluster(img, dirent);
+	    }
+	    else if ((cluster = make_dir(img, fm, dir, de->d_name)) == 0)
+	    {
+		fprintf(stderr, "No more space in filesystem\n");
+		job_failed(jobs);
+		jobs->full = TRUE;
+		continue;
+	    }
+	    tree_in(jobs, fm, sub, cluster);
+	    continue;
+	}
+	if (!S_ISREG(st.st_mode))
+	{
+	    fprintf(stderr, "%s isn't a regular file, so it was left out\n", sub);
+	    continue;
+	}
+	if ((uint64_t)st.st_size > UINT32_MAX)
+	{
+	    fprintf(stderr, "File %s is too big for a FAT filesystem\n", sub);
+	    job_failed(jobs);
+	    continue;
+	}
+
+	write_dirent(&entry, de->d_name, 0, st.st_size, ATTR_NORMAL, img);
+	get_name(fullname, &entry);
+	if (find_entry(img, dir, fullname) != NULL)
+	{
+	    fprintf(stderr, "File %s already exists\n", sub);
+	    job_failed(jobs);
+	    continue;
+	}
+	ex = NULL;
+	if (st.st_size > 0)
+	{
+	    ex = reserve_clusters(fm, (st.st_size + clust_size - 1) / clust_size);
+	    if (ex == NULL)
+	    {
+		fprintf(stderr, "No more space in filesystem\n");
+		job_failed(jobs);
+		jobs->full = TRUE;
+		continue;
+	    }
+	    set_dirent_cluster(img, &entry, ex->ext[0].start);
+	}
+	if (!add_entry(img, fm, dir, &entry))
+	{
+	    fprintf(stderr, "No room for %s in its directory\n", sub);
+	    if (ex != NULL)
+	    {
+		trim_extents(ex, 0, fm);
+		free_extents(ex);
+	    }
+	    job_failed(jobs);
+	    continue;
+	}
+	if (ex != NULL)
+	{
+	    set_fat_chain(img, ex);
+	}
+	add_job(jobs, sub, 0, st.st_size, ex, dir);
+    }
+    closedir(dp);
+}
+
+/* tree_out copies the directory dir in the image out to the real
+   directory path, making it if it isn't there */
+static void tree_out(struct copyjobs *jobs, uint32_t dir, char *path)
+{
+    struct dosimage *img = jobs->img;
+    struct dirwalk w;
+    struct direntry *dirent;
+    char sub[MAXPATHLEN], fullname[13];
+    uint32_t cluster;
+    size_t len;
+
+    if (mkdir(path, 0777) != 0 && errno != EEXIST)
+    {
+	fprintf(stderr, "Can't make directory %s: %s\n", path, strerror(errno));
+	job_failed(jobs);
+	return;
+    }
+    dirwalk_start(&w, img, dir);
+    while ((dirent = dirwalk_next(&w)) != NULL)
+    {
+	if (dirent->deName[0] == SLOT_EMPTY)
+	{
+	    break;
+	}
+	if (!is_listed(dirent))
+	{
+	    continue;
+	}
+
+	/* a file with no extension comes out without the dot */
+	get_name(fullname, dirent);
+	len = strlen(fullname);
+	if (len > 0 && fullname[len-1] == '.')
+	{
+	    fullname[len-1] = '\0';
+	}
+	if (snprintf(sub, sizeof(sub), "%s/%s", path, fullname) >= sizeof(sub))
+	{
+	    fprintf(stderr, "Path too long under %s\n", path);
+	    job_failed(jobs);
+	    continue;
+	}
+
+	cluster = dirent_cluster(img, dirent);
+	if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	{
+	    if (is_valid_cluster(img, cluster))
+	    {
+		tree_out(jobs, cluster, sub);
+	    }
+	    continue;
+	}
+	add_job(jobs, sub, cluster, getulong(dirent->deFileSize), NULL, dir);
+    }
+}
+
+/* run_job moves one file's data */
+static void run_job(struct copyjobs *jobs, struct copyjob *job)
+{
+    int64_t total = 0;
+    int fd;
+
+    if (jobs->copy_in)
+    {
+	fd = open(job->path, O_RDONLY);
+	if (fd >= 0 && job->ex != NULL)
+	{
+	    total = fill_clusters(fd, jobs->img, job->ex, job->size);
+	}
+	if (fd < 0 || total < 0)
+	{
+	    fprintf(stderr, "Can't read file %s: %s\n", job->path,
+		    strerror(errno));
+	    job_failed(jobs);
+	}
+	else
+	{
+	    job->got = total;
+	}
+	if (fd >= 0)
+	{
+	    close(fd);
+	}
+	return;
+    }
+
+    fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0
+	|| (job->size > 0
+	    && copy_out_file(fd, job->cluster, job->size, jobs->img) < 0)
+	|| close(fd) < 0)
+    {
+	fprintf(stderr, "Can't write file %s: %s\n", job->path,
+		strerror(errno));
+	job_failed(jobs);
+    }
+}
+
+static void *copy_worker(void *arg)
+{
+    struct copyjobs *jobs = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED))
+	   < jobs->count)
+    {
+	run_job(jobs, &jobs->jobs[i]);
+    }
+    return NULL;
+}
+
+/* run_jobs moves every file's data on nthreads threads, counting this
+   one; 0 means one per CPU */
+static void run_jobs(struct copyjobs *jobs, int nthreads)
+{
+    pthread_t *threads;
+    int t;
+
+    if (nthreads <= 0)
+    {
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > jobs->count)
+    {
+	nthreads = jobs->count;
+    }
+    if (nthreads <= 1)
+    {
+	copy_worker(jobs);
+	return;
+    }
+
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (t = 1; t < nthreads; t++)
+    {
+	if (pthread_create(&threads[t], NULL, copy_worker, jobs) != 0)
+	{
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+    copy_worker(jobs);
+    for (t = 1; t < nthreads; t++)
+    {
+	pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+/* shrink_job cuts the FAT chain and directory entry tree_in made for a
+   file down to the data that was really copied in, after the file
+   shrank under the copy */
+static void shrink_job(struct copyjobs *jobs, struct freemap *fm,
+		       struct copyjob *job)
+{
+    struct dosimage *img = jobs->img;
+    uint32_t clust_size = get_geometry(img)->clust_size;
+    struct direntry entry, *dirent;
+    struct dirwalk w;
+    char fullname[13];
+    uint32_t i, c;
+
+    fprintf(stderr, "%s shrank while it was copied in, so only its first "
+	    "%u bytes are in the image\n", job->path, job->got);
+
+    for (i = 0; i < job->ex->count; i++)
+    {
+	for (c = job->ex->ext[i].start;
+	     c < job->ex->ext[i].start + job->ex->ext[i].length; c++)
+	{
+	    set_fat_entry(img, c, CLUST_FREE);
+	}
+    }
+    trim_extents(job->ex, (job->got + clust_size - 1) / clust_size, fm);
+    set_fat_chain(img, job->ex);
+
+    write_dirent(&entry, strrchr(job->path, '/') + 1, 0, 0, ATTR_NORMAL, img);
+    get_name(fullname, &entry);
+    if (find_slot(&w, img, job->dir, fullname) != NULL)
+    {
+	dirent = dirwalk_write(&w);
+	set_dirent_cluster(img, dirent,
+			   job->ex->count > 0 ? job->ex->ext[0].start : 0);
+	putulong(dirent->deFileSize, job->got);
+    }
+}
+
+/* copytree copies a whole directory tree into or out of the image.
+   Returns 1 if anything couldn't be copied. */
+
+int copytree(char *infilename, char *outfilename, int nthreads,
+	     struct dosimage *img)
+{
+    struct copyjobs jobs;
+    struct freemap *fm = NULL;
+    struct stat st;
+    uint32_t dir;
+    int i;
+
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.img = img;
+    jobs.copy_in = strncmp("a:", outfilename, 2) == 0;
+    if (jobs.copy_in)
+    {
+	if (stat(infilename, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+	    fprintf(stderr, "%s isn't a directory\n", infilename);
+	    return 1;
+	}
+	fm = freemap_load(img);
+	if (!image_dir(img, fm, outfilename + 2, &dir))
+	{
+	    freemap_free(fm);
+	    return 1;
+	}
+	tree_in(&jobs, fm, infilename, dir);
+    }
+    else
+    {
+	if (!image_dir(img, NULL, infilename + 2, &dir))
+	{
+	    return 1;
+	}
+	tree_out(&jobs, dir, outfilename);
+    }
+
+    run_jobs(&jobs, nthreads);
+    for (i = 0; i < jobs.count; i++)
+    {
+	if (jobs.copy_in && jobs.jobs[i].got < jobs.jobs[i].size)
+	{
+	    shrink_job(&jobs, fm, &jobs.jobs[i]);
+	}
+	free(jobs.jobs[i].path);
+	if (jobs.jobs[i].ex != NULL)
+	{
+	    free_extents(jobs.jobs[i].ex);
+	}
+    }
+    free(jobs.jobs);
+    if (fm != NULL)
+    {
+	freemap_free(fm);
+    }
+    return jobs.failed;
+}
+
+/* Single copies name image paths like "a:DIR/FILE.EXT".  The
+   directory part is looked up a name at a time, and the last directory
+   found is remembered, so a run of copies into or out of one directory
+   only looks it up once.  Directories never move once they're made,
+   so what's remembered stays good. */
+struct dircache {
+    char path[MAXPATHLEN];
+    uint32_t cluster;
+    int valid;
+};
+
+/* split_image_path splits an "a:" path into its directory and its
+   last name */
+static void split_image_path(char *path, char *dir, char *name)
+{
+    char *p;
+
+    strncpy(dir, path + 2, MAXPATHLEN - 1);
+    dir[MAXPATHLEN - 1] = '\0';
+    p = dir + strlen(dir);
+    while (p > dir && p[-1] != '/' && p[-1] != '\\')
+    {
+	p--;
+    }
+    strcpy(name, p);
+    *p = '\0';
+    if (p > dir)
+    {
+	p[-1] = '\0';
+    }
+}
+
+static int cached_dir(struct dosimage *img, struct dircache *dc, char *dir,
+		      uint32_t *cluster)
+{
+    if (dc->valid && strcmp(dc->path, dir) == 0)
+    {
+	*cluster = dc->cluster;
+	return TRUE;
+    }
+    if (!image_dir(img, NULL, dir, cluster))
+    {
+	return FALSE;
+    }
+    strcpy(dc->path, dir);
+    dc->cluster = *cluster;
+    dc->valid = TRUE;
+    return TRUE;
+}
+
+/* copyout copies a file from the memory disk image to a regular file
+   in the file system.  Returns 1, having said why, if it can't. */
+
+int copyout(char *infilename, char* outfilename,
+	    struct dosimage *img, struct dircache *dc)
+{
+    struct direntry *dirent;
+    char dir[MAXPATHLEN], name[MAXPATHLEN];
+    uint32_t dir_cluster, start_cluster, size;
+    int fd;
+
+    /* skip the volume name */
+    assert(strncmp("a:", infilename, 2)==0);
+
+    /* find the dirent of the file in the memory disk image */
+    split_image_path(infilename, dir, name);
+    if (!cached_dir(img, dc, dir, &dir_cluster))
+    {
+	return 1;
+    }
+    dirent = find_entry(img, dir_cluster, name);
+    if (dirent == NULL) 
+    {
+	fprintf(stderr, "No file called %s exists in the disk image\n",
+		infilename + 2);
+	return 1;
+    }
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    {
+	fprintf(stderr, "Cannot copy out a directory\n");
+	return 1;
+    }
+    start_cluster = dirent_cluster(img, dirent);
+    size = getulong(dirent->deFileSize);
+
+    /* open the real file for writing */
+    fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) 
+    {
+	fprintf(stderr, "Can't open file %s to copy data out\n",
+		outfilename);
+	return 1;
+    }
+
+    /* do the actual copy out*/
+    if ((size > 0 && copy_out_file(fd, start_cluster, size, img) < 0)
+	|| close(fd) < 0)
+    {
+	fprintf(stderr, "Can't write file %s: %s\n", outfilename,
+		strerror(errno));
+	return 1;
+    }
+    return 0;
 }
 
 /* copyin copies a file from a regular file on the filesystem into a
-   file in the FAT-12 memory disk image  */
+   file in the memory disk image.  Returns 1, having said why, if it
+   can't. */
 
-void copyin(char *infilename, char* outfilename,
-	    uint8_t *image_buf, struct bpb33* bpb)
+int copyin(char *infilename, char* outfilename, struct dosimage *img,
+	   struct freemap *fm, struct dircache *dc)
 {
-    struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
-    uint32_t size = 0;
+    struct direntry entry;
+    char dir[MAXPATHLEN], name[MAXPATHLEN], fullname[13];
+    uint32_t dir_cluster, start_cluster, size;
+    int fd, status;
 
     assert(strncmp("a:", outfilename, 2)==0);
-    outfilename+=2;
 
-    /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent != NULL) 
+    /* find the directory to put the file in */
+    split_image_path(outfilename, dir, name);
+    if (!cached_dir(img, dc, dir, &dir_cluster))
     {
-	fprintf(stderr, "File %s already exists\n", outfilename);
-	exit(1);
+	return 1;
     }
 
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) 
+    /* check that the file doesn't already exist */
+    write_dirent(&entry, name, 0, 0, ATTR_NORMAL, img);
+    get_name(fullname, &entry);
+    if (find_entry(img, dir_cluster, fullname) != NULL) 
     {
-	fprintf(stderr, "Directory does not exists in the disk image\n");
-	exit(1);
+	fprintf(stderr, "File %s already exists\n", outfilename + 2);
+	return 1;
     }
 
     /* open the real file for reading */
-    fd = fopen(infilename, "r");
-    if (fd == NULL) 
+    fd = open(infilename, O_RDONLY);
+    if (fd < 0) 
     {
 	fprintf(stderr, "Can't open file %s to copy data in\n",
 		infilename);
-	exit(1);
+	return 1;
     }
 
     /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
+    status = copy_in_file(fd, img, fm, &start_cluster, &size);
+    close(fd);
+    if (status < 0)
+    {
+	return 1;
+    }
 
     /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
-    
-    fclose(fd);
+    set_dirent_cluster(img, &entry, start_cluster);
+    putulong(entry.deFileSize, size);
+    if (!add_entry(img, fm, dir_cluster, &entry))
+    {
+	fprintf(stderr, "No room for %s in its directory\n", outfilename + 2);
+	if (start_cluster != 0)
+	{
+	    free_chain(img, fm, start_cluster);
+	}
+	return 1;
+    }
+    return 0;
+}
+
+/* copybatch makes every copy listed in a manifest ("-" for stdin)
+   against the one open image, so the image is opened, checked and
+   synced once for all of them, and the free map and the last directory
+   looked up are kept from one copy to the next.  Each line is a copy,
+   its two names given just as they would be on the command line and
+   separated by a tab, or by spaces if there's no tab; blank lines and
+   lines starting with # are skipped.  A copy that fails is reported
+   and the rest still happen.  Returns 1 if any failed. */
+
+int copybatch(char *manifest, struct dosimage *img)
+{
+    char line[2 * MAXPATHLEN + 2];
+    char *from, *to, *sep;
+    struct freemap *fm = NULL;
+    struct dircache dc;
+    int lineno = 0, copies = 0, failed = 0;
+    FILE *f;
+
+    f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (f == NULL)
+    {
+	perror(manifest);
+	return 1;
+    }
+    dc.valid = FALSE;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+	lineno++;
+	line[strcspn(line, "\r\n")] = '\0';
+	from = line + strspn(line, " \t");
+	if (*from == '\0' || *from == '#')
+	{
+	    continue;
+	}
+	sep = strchr(from, '\t');
+	if (sep == NULL)
+	{
+	    sep = strchr(from, ' ');
+	}
+	to = NULL;
+	if (sep != NULL)
+	{
+	    *sep = '\0';
+	    to = sep + 1 + strspn(sep + 1, " \t");
+	}
+
+	copies++;
+	if (to != NULL && strncmp("a:", from, 2) == 0)
+	{
+	    failed += copyout(from, to, img, &dc);
+	}
+	else if (to != NULL && strncmp("a:", to, 2) == 0)
+	{
+	    if (fm == NULL)
+	    {
+		fm = freemap_load(img);
+	    }
+	    failed += copyin(from, to, img, fm, &dc);
+	}
+	else
+	{
+	    fprintf(stderr, "%s: can't read line %d\n", manifest, lineno);
+	    failed++;
+	}
+    }
+    if (f != stdin)
+    {
+	fclose(f);
+    }
+    if (fm != NULL)
+    {
+	freemap_free(fm);
+    }
+    if (failed > 0)
+    {
+	fprintf(stderr, "%d of %d copies failed\n", failed, copies);
+    }
+    return failed > 0;
 }
 
 void usage(char *progname)
@@ -498,38 +1484,113 @@ void usage(char *progname)
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
     fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "\tnames in the image match in any case; a full subdirectory\n");
+    fprintf(stderr, "\tgrows by a cluster; a failed copy in leaves the image as it was\n");
+    fprintf(stderr, "usage: %s -r [-j threads] <imagename> a:<dir1> <dir2>\n", progname);
+    fprintf(stderr, "usage: %s -r [-j threads] <imagename> <dir3> a:<dir4>\n", progname);
+    fprintf(stderr, "\tcopies a whole directory tree out of or into the disk image,\n");
+    fprintf(stderr, "\tmaking directories as needed; the files' data is moved on\n");
+    fprintf(stderr, "\tthreads threads (0 -> one per CPU, default 1)\n");
+    fprintf(stderr, "usage: %s -m <manifest> <imagename>\n", progname);
+    fprintf(stderr, "\tmakes every copy listed in manifest (- for stdin), one per\n");
+    fprintf(stderr, "\tline as <name1> <name2>, opening the image just once\n");
     exit(1);
 }
 
 int main(int argc, char** argv)
 {
-    int fd;
-    uint8_t *image_buf;
-    struct bpb33* bpb;
-    if (argc < 4 || argc > 4) 
+    struct dosimage *img;
+    struct freemap *fm;
+    struct dircache dc;
+    char *manifest = NULL;
+    int opt, recursive = 0, nthreads = 1, status = 0;
+
+    while ((opt = getopt(argc, argv, "rj:m:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'm':
+	    manifest = optarg;
+	    break;
+	case 'r':
+	    recursive = 1;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (manifest != NULL && argc == 2 && !recursive)
+    {
+	img = open_image(argv[1], IMAGE_RDWR);
+	if (img == NULL)
+	{
+	    exit(1);
+	}
+	status = copybatch(manifest, img);
+	close_image(img);
+	return status;
+    }
+    if (argc != 4 || manifest != NULL) 
     {
 	usage(argv[0]);
     }
+    dc.valid = FALSE;
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-
+    if (recursive)
+    {
+	/* the tree goes whichever way the "a:" says */
+	if (strncmp("a:", argv[2], 2) == 0)
+	{
+	    img = open_image(argv[1], IMAGE_RDONLY);
+	}
+	else if (strncmp("a:", argv[3], 2) == 0)
+	{
+	    img = open_image(argv[1], IMAGE_RDWR);
+	}
+	else
+	{
+	    usage(argv[0]);
+	}
+	if (img == NULL)
+	{
+	    exit(1);
+	}
+	status = copytree(argv[2], argv[3], nthreads, img);
+    }
     /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0) 
+    else if (strncmp("a:", argv[2], 2)==0) 
     {
-	/* copy from FAT-12 disk image to external filesystem */
-	copyout(argv[2], argv[3], image_buf, bpb);
+	/* copy from FAT-12 disk image to external filesystem; the
+	   image is only read, so map it read-only */
+	img = open_image(argv[1], IMAGE_RDONLY);
+	if (img == NULL)
+	{
+	    exit(1);
+	}
+	status = copyout(argv[2], argv[3], img, &dc);
     }
     else if (strncmp("a:", argv[3], 2)==0) 
     {
 	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
+	img = open_image(argv[1], IMAGE_RDWR);
+	if (img == NULL)
+	{
+	    exit(1);
+	}
+	fm = freemap_load(img);
+	status = copyin(argv[2], argv[3], img, fm, &dc);
+	freemap_free(fm);
     } 
     else 
     {
 	usage(argv[0]);
     }
 
-    unmmap_file(image_buf, &fd);
-    return 0;
+    close_image(img);
+    return status;
 }
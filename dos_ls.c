@@ -13,25 +13,26 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "log.h"
 
+/* the listing collects here and goes out in large writes */
+static struct logbuf out;
 
 void print_indent(int indent)
 {
-    int i;
-    for (i = 0; i < indent*4; i++)
-	printf(" ");
+    log_indent(&out, LOG_TREE, indent*4);
 }
 
 
-uint16_t print_dirent(struct direntry *dirent, int indent)
+uint32_t print_dirent(struct direntry *dirent, int indent, struct dosimage *img)
 {
-    uint16_t followclust = 0;
+    uint32_t followclust = 0;
 
     int i;
     char name[9];
     char extension[4];
     uint32_t size;
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
@@ -80,7 +81,7 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
     }
     else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
     {
-	printf("Volume: %s\n", name);
+	log_printf(&out, LOG_TREE, "Volume: %s\n", name);
     } 
     else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
     {
@@ -89,8 +90,8 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
 	    print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
-            file_cluster = getushort(dirent->deStartCluster);
+    	    log_printf(&out, LOG_TREE, "%s/ (directory)\n", name);
+            file_cluster = dirent_cluster(img, dirent);
             followclust = file_cluster;
         }
     }
@@ -107,8 +108,8 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 
 	size = getulong(dirent->deFileSize);
 	print_indent(indent);
-	printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
-	       name, extension, size, getushort(dirent->deStartCluster),
+	log_printf(&out, LOG_TREE, "%s.%s (%u bytes) (starting cluster %u) %c%c%c%c\n", 
+	       name, extension, size, dirent_cluster(img, dirent),
 	       ro?'r':' ', 
                hidden?'h':' ', 
                sys?'s':' ', 
@@ -119,41 +120,56 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 }
 
 
-void follow_dir(uint16_t cluster, int indent,
-		uint8_t *image_buf, struct bpb33* bpb)
+void follow_dir(uint32_t cluster, int indent, struct dosimage *img)
 {
-    while (is_valid_cluster(cluster, bpb))
+    while (is_valid_cluster(img, cluster))
     {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(img, cluster);
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+        int numDirEntries = get_geometry(img)->clust_size / sizeof(struct direntry);
         int i = 0;
 	for ( ; i < numDirEntries; i++)
 	{
             
-            uint16_t followclust = print_dirent(dirent, indent);
+            uint32_t followclust = print_dirent(dirent, indent, img);
             if (followclust)
-                follow_dir(followclust, indent+1, image_buf, bpb);
+            {
+                follow_dir(followclust, indent+1, img);
+                /* the subdirectory may have pushed this cluster out of
+                   the sector cache */
+                dirent = (struct direntry*)cluster_to_addr(img, cluster) + i;
+            }
             dirent++;
 	}
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+	cluster = get_fat_entry(img, cluster);
     }
 }
 
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
+void traverse_root(struct dosimage *img)
 {
     uint16_t cluster = 0;
+    const struct dosgeom *geom = get_geometry(img);
+
+    if (geom->fattype == 32)
+    {
+        /* FAT-32 has no fixed root directory, just a cluster chain */
+        follow_dir(geom->root_cluster, 0, img);
+        return;
+    }
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    struct direntry *dirent = (struct direntry*)cluster_to_addr(img, cluster);
 
     int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    for ( ; i < geom->root_ents; i++)
     {
-        uint16_t followclust = print_dirent(dirent, 0);
-        if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb);
+        uint32_t followclust = print_dirent(dirent, 0, img);
+        if (is_valid_cluster(img, followclust))
+        {
+            follow_dir(followclust, 1, img);
+            dirent = (struct direntry*)cluster_to_addr(img, cluster) + i;
+        }
 
         dirent++;
     }
@@ -169,19 +185,22 @@ void usage(char *progname)
 
 int main(int argc, char** argv)
 {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
+    struct dosimage *img;
     if (argc != 2)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    traverse_root(image_buf, bpb);
+    img = open_image(argv[1], IMAGE_RDONLY);
+    if (img == NULL)
+    {
+	exit(1);
+    }
+    log_open(&out, STDOUT_FILENO, LOG_TREE);
+    traverse_root(img);
+    log_close(&out);
 
-    unmmap_file(image_buf, &fd);
+    close_image(img);
 
     return 0;
 }
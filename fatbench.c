@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dos.h"
+
+/* fatbench times the bulk FAT-12 codecs in dos.c and reports their
+   throughput in entries/sec.  Build with optimisation on, e.g.
+   "make fatbench CFLAGS=-O2". */
+
+#define DEFAULT_GROUPS (1 << 20)
+#define DEFAULT_ROUNDS 50
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [groups] [rounds]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t ngroups = DEFAULT_GROUPS;
+    int rounds = DEFAULT_ROUNDS;
+    const struct fat12_codec *c;
+    uint8_t *fat, *packed;
+    uint16_t *entries, *expected;
+    double start, secs;
+    uint32_t i;
+    int r;
+
+    if (argc > 3)
+	usage(argv[0]);
+    if (argc > 1)
+	ngroups = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+	rounds = atoi(argv[2]);
+    if (ngroups == 0 || rounds <= 0)
+	usage(argv[0]);
+
+    fat = malloc(3 * ngroups);
+    packed = malloc(3 * ngroups);
+    entries = malloc(2 * ngroups * sizeof(uint16_t));
+    expected = malloc(2 * ngroups * sizeof(uint16_t));
+
+    srandom(301);
+    for (i = 0; i < 3 * ngroups; i++)
+	fat[i] = random();
+
+    /* the scalar codec is last in the table, and is the reference */
+    for (c = fat12_codecs; c[1].name != NULL; c++)
+	;
+    c->unpack(fat, expected, ngroups);
+
+    printf("%u entries, %d rounds, dispatch picks %s\n",
+	   2 * ngroups, rounds, fat12_best_codec()->name);
+    for (c = fat12_codecs; c->name != NULL; c++)
+    {
+	if (!c->supported())
+	{
+	    printf("%-8s not supported on this CPU\n", c->name);
+	    continue;
+	}
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+	    c->unpack(fat, entries, ngroups);
+	secs = now() - start;
+	if (memcmp(entries, expected, 2 * ngroups * sizeof(uint16_t)) != 0)
+	{
+	    fprintf(stderr, "%s unpack does not match scalar\n", c->name);
+	    exit(1);
+	}
+	printf("%-8s unpack %8.1f M entries/sec\n", c->name,
+	       2.0 * ngroups * rounds / secs / 1e6);
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+	    c->pack(entries, packed, ngroups);
+	secs = now() - start;
+	if (memcmp(packed, fat, 3 * ngroups) != 0)
+	{
+	    fprintf(stderr, "%s pack does not match original FAT\n", c->name);
+	    exit(1);
+	}
+	printf("%-8s pack   %8.1f M entries/sec\n", c->name,
+	       2.0 * ngroups * rounds / secs / 1e6);
+    }
+
+    free(fat);
+    free(packed);
+    free(entries);
+    free(expected);
+    return 0;
+}
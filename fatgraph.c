@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fat.h"
+#include "dos.h"
+#include "fatgraph.h"
+
+/* The walk colours clusters the usual way: white until reached, grey
+   while on the current path, black once done.  Each white cluster
+   starts a path that follows the FAT until it leaves the data area,
+   reaches a black cluster, or comes back to a grey one, which closes
+   a loop.  Unwinding the path then fills in each cluster from the one
+   after it, so every cluster is pushed and popped once and no chain is
+   walked twice.  The path is an explicit stack, since one chain can be
+   as long as the volume. */
+
+#define WHITE	0
+#define GREY	1
+#define BLACK	2
+
+struct fatgraph *fatgraph_build(struct dosimage *img)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    struct fatgraph *g;
+    uint32_t n = geom->max_cluster;
+    uint32_t *stack, sp, c, start, i, len;
+    uint8_t *colour;
+
+    g = malloc(sizeof(struct fatgraph));
+    g->max_cluster = n;
+    g->length = calloc(n, sizeof(uint32_t));
+
+    /* the FAT is read into length in one go.  A cluster's FAT entry is
+       only needed while it is white, and its length is only written
+       once it is black, so the two can share the array. */
+    if (n > CLUST_FIRST)
+	get_fat_entries(img, CLUST_FIRST, n - CLUST_FIRST,
+			g->length + CLUST_FIRST);
+
+    colour = calloc(n, 1);
+    stack = malloc(n * sizeof(uint32_t));
+    for (start = CLUST_FIRST; start < n; start++)
+    {
+	if (colour[start] != WHITE)
+	    continue;
+
+	sp = 0;
+	c = start;
+	while (c >= CLUST_FIRST && c < n && colour[c] == WHITE)
+	{
+	    colour[c] = GREY;
+	    stack[sp++] = c;
+	    c = g->length[c];
+	}
+
+	if (c < CLUST_FIRST || c >= n)
+	{
+	    /* the chain ends here */
+	    len = 0;
+	}
+	else if (colour[c] == BLACK)
+	{
+	    /* it joins a chain that's already done */
+	    len = g->length[c];
+	}
+	else
+	{
+	    /* back to a grey cluster: c and everything after it on the
+	       stack is a loop, and all of it is the same length */
+	    for (i = sp; stack[i-1] != c; i--)
+		;
+	    len = sp - (i - 1);
+	    while (sp >= i)
+	    {
+		c = stack[--sp];
+		g->length[c] = len;
+		colour[c] = BLACK;
+	    }
+	}
+
+	while (sp > 0)
+	{
+	    c = stack[--sp];
+	    g->length[c] = ++len;
+	    colour[c] = BLACK;
+	}
+    }
+    free(stack);
+    free(colour);
+    return g;
+}
+
+void fatgraph_free(struct fatgraph *g)
+{
+    free(g->length);
+    free(g);
+}
@@ -0,0 +1,33 @@
+#ifndef __FATGRAPH_H__
+#define __FATGRAPH_H__
+
+#include <stdint.h>
+
+/* The FAT as a graph: every data cluster points at the next cluster of
+   its chain, or at nothing.  fatgraph_build works out, in one pass over
+   the FAT, how long the chain starting at each cluster is, so that is
+   a lookup afterwards.
+
+   The answers are for the FAT as it was when the graph was built.
+   Cutting a chain short (setting an entry to EOF or free) can only
+   shorten the chains through it, so the lengths stay upper bounds
+   after that. */
+
+struct dosimage;
+
+struct fatgraph {
+    uint32_t max_cluster;	/* one past the last data cluster */
+    uint32_t *length;		/* clusters on the chain from here, each
+				   counted once even if the chain loops */
+};
+
+struct fatgraph *fatgraph_build(struct dosimage *);
+void fatgraph_free(struct fatgraph *);
+
+/* returns 0 for anything that isn't a data cluster */
+static inline uint32_t fatgraph_length(struct fatgraph *g, uint32_t cluster)
+{
+    return cluster < g->max_cluster ? g->length[cluster] : 0;
+}
+
+#endif // __FATGRAPH_H__
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+/* imagebench compares the mmap and pread image backends.  Each run
+   opens the image, walks every directory and reads every file, the
+   way dos_ls followed by dos_cat on each file would.  The cold run
+   asks the kernel to drop the image from the page cache first; the
+   warm runs go straight after it. */
+
+#define DEFAULT_ROUNDS 5
+
+struct walk {
+    struct dosimage *img;
+    uint8_t *buf;		/* CLUSTER_IO_BYTES, for read_clusters */
+    uint64_t bytes;		/* file data read */
+    uint64_t sum;		/* so the data is really touched */
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_file(struct walk *w, uint32_t cluster, uint32_t size)
+{
+    uint32_t clust_size = get_geometry(w->img)->clust_size;
+    uint32_t chunk = CLUSTER_IO_BYTES / clust_size;
+    struct extents *ex;
+    uint32_t i, start, left, n;
+    uint64_t *p, j;
+
+    if (chunk == 0)
+	chunk = 1;
+    ex = get_extents(w->img, cluster);
+    for (i = 0; i < ex->count && size > 0; i++)
+    {
+	start = ex->ext[i].start;
+	left = ex->ext[i].length;
+	while (left > 0 && size > 0)
+	{
+	    n = (size + clust_size - 1) / clust_size;
+	    if (n > left)
+		n = left;
+	    if (n > chunk)
+		n = chunk;
+	    p = (uint64_t *)read_clusters(w->img, start, n, w->buf);
+	    for (j = 0; j < (uint64_t)n * clust_size / 8; j++)
+		w->sum += p[j];
+	    w->bytes += (uint64_t)n * clust_size;
+	    size = size > n * clust_size ? size - n * clust_size : 0;
+	    start += n;
+	    left -= n;
+	}
+    }
+    free_extents(ex);
+}
+
+/* walk_dir reads everything below a directory; cluster 0 is the fixed
+   root directory of a FAT-12 or FAT-16 volume */
+static void walk_dir(struct walk *w, uint32_t cluster)
+{
+    const struct dosgeom *geom = get_geometry(w->img);
+    struct direntry *dirent;
+    uint32_t i, nents, child;
+
+    while (cluster == 0 || is_valid_cluster(w->img, cluster))
+    {
+	nents = cluster == 0 ? geom->root_ents
+	    : geom->clust_size / sizeof(struct direntry);
+	for (i = 0; i < nents; i++)
+	{
+	    /* fetched every time, as a subdirectory may have pushed the
+	       cluster out of the sector cache */
+	    dirent = (struct direntry *)cluster_to_addr(w->img, cluster) + i;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    child = dirent_cluster(w->img, dirent);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	    {
+		if (is_valid_cluster(w->img, child))
+		    walk_dir(w, child);
+	    }
+	    else if (is_valid_cluster(w->img, child))
+	    {
+		read_file(w, child, getulong(dirent->deFileSize));
+	    }
+	}
+	if (cluster == 0)
+	    return;
+	cluster = get_fat_entry(w->img, cluster);
+    }
+}
+
+/* run opens the image with the given flags, reads it all and returns
+   how long that took */
+static double run(char *filename, int flags, int cold, struct walk *w)
+{
+    const struct dosgeom *geom;
+    double start;
+    int fd;
+
+    if (cold)
+    {
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+	    fprintf(stderr, "can't drop %s from the page cache\n", filename);
+	if (fd >= 0)
+	    close(fd);
+    }
+
+    start = now();
+    w->img = open_image(filename, flags);
+    if (w->img == NULL)
+	exit(1);
+    geom = get_geometry(w->img);
+    w->bytes = 0;
+    walk_dir(w, geom->fattype == 32 ? geom->root_cluster : 0);
+    close_image(w->img);
+    return now() - start;
+}
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <imagename> [rounds]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    static const int backends[] = { IMAGE_RDONLY, IMAGE_RDONLY | IMAGE_PREAD };
+    static const char *names[] = { "mmap", "pread" };
+    struct walk w;
+    double secs, best;
+    int rounds = DEFAULT_ROUNDS;
+    int b, r;
+
+    if (argc < 2 || argc > 3)
+	usage(argv[0]);
+    if (argc > 2)
+	rounds = atoi(argv[2]);
+    if (rounds <= 0)
+	usage(argv[0]);
+
+    w.buf = malloc(CLUSTER_IO_BYTES);
+    w.sum = 0;
+    for (b = 0; b < 2; b++)
+    {
+	secs = run(argv[1], backends[b], TRUE, &w);
+	printf("%-6s cold %9.2f ms %9.1f MB/s\n", names[b], secs * 1e3,
+	       w.bytes / secs / 1e6);
+
+	best = 0;
+	for (r = 0; r < rounds; r++)
+	{
+	    secs = run(argv[1], backends[b], FALSE, &w);
+	    if (r == 0 || secs < best)
+		best = secs;
+	}
+	printf("%-6s warm %9.2f ms %9.1f MB/s (best of %d)\n", names[b],
+	       best * 1e3, w.bytes / best / 1e6, rounds);
+    }
+    printf("%llu bytes of file data, checksum %llx\n",
+	   (unsigned long long)w.bytes, (unsigned long long)w.sum);
+
+    free(w.buf);
+    return 0;
+}
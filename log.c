@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "log.h"
+
+void log_open(struct logbuf *log, int fd, int level)
+{
+    log->level = level;
+    log->fd = fd;
+    log->buf = level > LOG_QUIET && fd >= 0 ? malloc(LOG_BUFSIZE) : NULL;
+    log->len = 0;
+}
+
+static void write_all(int fd, const char *p, size_t n)
+{
+    ssize_t done;
+
+    while (n > 0)
+    {
+	done = write(fd, p, n);
+	if (done < 0 && errno == EINTR)
+	    continue;
+	if (done <= 0)
+	    return;		/* nowhere for it to go */
+	p += done;
+	n -= done;
+    }
+}
+
+void log_flush(struct logbuf *log)
+{
+    if (log->len > 0)
+	write_all(log->fd, log->buf, log->len);
+    log->len = 0;
+}
+
+void log_close(struct logbuf *log)
+{
+    log_flush(log);
+    free(log->buf);
+    log->buf = NULL;
+}
+
+void log_vprintf(struct logbuf *log, int level, const char *fmt, va_list ap)
+{
+    va_list again;
+    char *big;
+    int n;
+
+    if (!log_wants(log, level))
+	return;
+
+    va_copy(again, ap);
+    n = vsnprintf(log->buf + log->len, LOG_BUFSIZE - log->len, fmt, ap);
+    if (n >= 0 && (size_t)n >= LOG_BUFSIZE - log->len)
+    {
+	/* it didn't fit: make room and try again, and if it can never
+	   fit write it on its own */
+	log_flush(log);
+	if (n < LOG_BUFSIZE)
+	{
+	    n = vsnprintf(log->buf, LOG_BUFSIZE, fmt, again);
+	}
+	else
+	{
+	    big = malloc(n + 1);
+	    vsnprintf(big, n + 1, fmt, again);
+	    write_all(log->fd, big, n);
+	    free(big);
+	    n = 0;
+	}
+    }
+    va_end(again);
+    if (n > 0)
+	log->len += n;
+}
+
+void log_printf(struct logbuf *log, int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vprintf(log, level, fmt, ap);
+    va_end(ap);
+}
+
+void log_indent(struct logbuf *log, int level, int n)
+{
+    if (!log_wants(log, level) || n <= 0)
+	return;
+    if (n > LOG_BUFSIZE)
+	n = LOG_BUFSIZE;
+    if (log->len + n > LOG_BUFSIZE)
+	log_flush(log);
+    memset(log->buf + log->len, ' ', n);
+    log->len += n;
+}
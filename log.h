@@ -0,0 +1,43 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdarg.h>
+
+/* Output for the tools' listings and reports.  Every line is written
+   at a level, and only kept if the log is at least that verbose;
+   callers with anything costly to work out ask log_wants first, so
+   nothing is formatted for a level nobody asked for.  What is kept
+   collects in one buffer that goes out in large writes. */
+
+#define LOG_QUIET	0	/* nothing */
+#define LOG_FINDINGS	1	/* problems found and what was done about them */
+#define LOG_TREE	2	/* the whole directory tree as well */
+
+#define LOG_BUFSIZE	(1 << 16)
+
+struct logbuf {
+    int level;
+    int fd;			/* where it goes; -1 for nowhere */
+    char *buf;
+    size_t len;			/* bytes waiting in buf */
+};
+
+/* log_open sets up a log writing to fd at level, and log_close writes
+   out whatever is left and frees the buffer */
+void log_open(struct logbuf *, int fd, int level);
+void log_close(struct logbuf *);
+void log_flush(struct logbuf *);
+
+static inline int log_wants(struct logbuf *log, int level)
+{
+    return level <= log->level && log->fd >= 0;
+}
+
+void log_printf(struct logbuf *, int level, const char *, ...)
+    __attribute__((format(printf, 3, 4)));
+void log_vprintf(struct logbuf *, int level, const char *, va_list);
+
+/* log_indent writes n spaces */
+void log_indent(struct logbuf *, int level, int n);
+
+#endif // __LOG_H__
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "plan.h"
+
+/* Edits are kept in the order they were made until the plan is saved
+   or applied.  Then they are sorted by where they land in the image,
+   and edits that land in the same place are folded into one, which
+   keeps the first edit's old value and the last one's new value. */
+
+struct repairplan *plan_new(struct dosimage *img)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    struct repairplan *plan;
+
+    plan = calloc(1, sizeof(struct repairplan));
+    plan->fattype = geom->fattype;
+    plan->total_secs = geom->total_secs;
+    plan->clust_size = geom->clust_size;
+    return plan;
+}
+
+void plan_free(struct repairplan *plan)
+{
+    free(plan->edits);
+    free(plan);
+}
+
+static struct planedit *add_edit(struct repairplan *plan, int kind,
+				 uint32_t cluster, uint32_t slot)
+{
+    struct planedit *e;
+
+    if (plan->nedits == plan->maxedits)
+    {
+	plan->maxedits = plan->maxedits ? 2 * plan->maxedits : 64;
+	plan->edits = realloc(plan->edits,
+			      plan->maxedits * sizeof(struct planedit));
+    }
+    e = &plan->edits[plan->nedits];
+    memset(e, 0, sizeof(struct planedit));
+    e->kind = kind;
+    e->cluster = cluster;
+    e->slot = slot;
+    e->seq = plan->nedits++;
+    return e;
+}
+
+void plan_set_fat(struct repairplan *plan, uint32_t cluster,
+		  uint32_t oldval, uint32_t newval)
+{
+    struct planedit *e = add_edit(plan, PLAN_FAT, cluster, 0);
+    e->oldval = oldval;
+    e->newval = newval;
+}
+
+static int slot_in_use(const uint8_t *dirent)
+{
+    return dirent[0] != SLOT_EMPTY && dirent[0] != SLOT_DELETED;
+}
+
+void plan_dirent(struct repairplan *plan, uint32_t cluster, uint32_t slot,
+		 const struct direntry *olddirent,
+		 const struct direntry *newdirent)
+{
+    struct planedit *e = add_edit(plan, PLAN_DIRENT, cluster, slot);
+
+    memcpy(e->olddirent, olddirent, 32);
+    memcpy(e->newdirent, newdirent, 32);
+    if (!slot_in_use(e->olddirent) && slot_in_use(e->newdirent))
+	e->kind = PLAN_NEWENT;
+}
+
+
+/* check_edit returns true if the edit names a FAT entry or directory
+   slot that exists in an image with this geometry */
+static int check_edit(const struct dosgeom *geom, struct planedit *e)
+{
+    if (e->kind == PLAN_FAT)
+	return e->cluster >= CLUST_FIRST && e->cluster < geom->max_cluster;
+    if (e->cluster == MSDOSFSROOT && geom->fattype != 32)
+	return e->slot < geom->root_ents;
+    return (e->cluster == MSDOSFSROOT
+	    || (e->cluster >= CLUST_FIRST && e->cluster < geom->max_cluster))
+	&& e->slot < geom->clust_size / sizeof(struct direntry);
+}
+
+static uint64_t edit_offset(const struct dosgeom *geom, struct planedit *e)
+{
+    uint32_t cluster = e->cluster;
+
+    if (e->kind == PLAN_FAT)
+	return geom->fat_offset + (uint64_t)cluster * geom->fattype / 8;
+    if (cluster == MSDOSFSROOT && geom->fattype != 32)
+	return geom->root_offset + (uint64_t)e->slot * sizeof(struct direntry);
+    if (cluster == MSDOSFSROOT)
+	cluster = geom->root_cluster;
+    return geom->data_offset + (uint64_t)geom->clust_size * (cluster - CLUST_FIRST)
+	+ (uint64_t)e->slot * sizeof(struct direntry);
+}
+
+static int compare_edits(const void *a, const void *b)
+{
+    const struct planedit *ea = a, *eb = b;
+
+    if (ea->offset != eb->offset)
+	return ea->offset < eb->offset ? -1 : 1;
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+/* sort_plan puts the edits in image order and folds together the ones
+   that land in the same place.  It returns FALSE if any edit doesn't
+   fit the geometry. */
+static int sort_plan(struct repairplan *plan, const struct dosgeom *geom)
+{
+    struct planedit *e, *last;
+    uint32_t i, n;
+
+    for (i = 0; i < plan->nedits; i++)
+    {
+	e = &plan->edits[i];
+	if (!check_edit(geom, e))
+	{
+	    fprintf(stderr, "plan: edit %u is outside the image\n", e->seq);
+	    return FALSE;
+	}
+	e->offset = edit_offset(geom, e);
+    }
+    qsort(plan->edits, plan->nedits, sizeof(struct planedit), compare_edits);
+
+    n = 0;
+    for (i = 0; i < plan->nedits; i++)
+    {
+	e = &plan->edits[i];
+	last = n > 0 ? &plan->edits[n-1] : NULL;
+	if (last != NULL && last->offset == e->offset)
+	{
+	    last->newval = e->newval;
+	    memcpy(last->newdirent, e->newdirent, 32);
+	    if (last->kind != PLAN_FAT)
+		last->kind = slot_in_use(last->olddirent)
+		    || !slot_in_use(last->newdirent) ? PLAN_DIRENT : PLAN_NEWENT;
+	    continue;
+	}
+	plan->edits[n++] = *e;
+    }
+    plan->nedits = n;
+    return TRUE;
+}
+
+static void save_hex(FILE *f, const uint8_t *bytes)
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+	fprintf(f, "%02x", bytes[i]);
+}
+
+static int load_hex(const char *s, uint8_t *bytes)
+{
+    unsigned int byte;
+    int i;
+
+    if (strlen(s) != 64)
+	return FALSE;
+    for (i = 0; i < 32; i++)
+    {
+	if (sscanf(s + 2*i, "%2x", &byte) != 1)
+	    return FALSE;
+	bytes[i] = byte;
+    }
+    return TRUE;
+}
+
+void plan_save(struct repairplan *plan, struct dosimage *img, FILE *f)
+{
+    static const char *kinds[] = { NULL, "fat", "dirent", "newent" };
+    struct planedit *e;
+    uint32_t i;
+
+    sort_plan(plan, get_geometry(img));
+    fprintf(f, "plan fat%d %u %u\n", plan->fattype, plan->total_secs,
+	    plan->clust_size);
+    for (i = 0; i < plan->nedits; i++)
+    {
+	e = &plan->edits[i];
+	if (e->kind == PLAN_FAT)
+	{
+	    fprintf(f, "fat %u %x %x\n", e->cluster, e->oldval, e->newval);
+	    continue;
+	}
+	fprintf(f, "%s %u %u ", kinds[e->kind], e->cluster, e->slot);
+	save_hex(f, e->olddirent);
+	fprintf(f, " ");
+	save_hex(f, e->newdirent);
+	fprintf(f, "\n");
+    }
+}
+
+struct repairplan *plan_load(FILE *f)
+{
+    struct repairplan *plan;
+    struct planedit *e;
+    char line[256], kind[16], oldhex[80], newhex[80];
+    uint32_t cluster, slot, oldval, newval;
+    int lineno = 1;
+
+    plan = calloc(1, sizeof(struct repairplan));
+    if (fgets(line, sizeof(line), f) == NULL
+	|| sscanf(line, "plan fat%d %u %u", &plan->fattype, &plan->total_secs,
+		  &plan->clust_size) != 3)
+    {
+	fprintf(stderr, "plan: not a repair plan\n");
+	plan_free(plan);
+	return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+	lineno++;
+	if (sscanf(line, "fat %u %x %x", &cluster, &oldval, &newval) == 3)
+	{
+	    plan_set_fat(plan, cluster, oldval, newval);
+	    continue;
+	}
+	if (sscanf(line, "%15s %u %u %79s %79s", kind, &cluster, &slot,
+		   oldhex, newhex) == 5
+	    && (strcmp(kind, "dirent") == 0 || strcmp(kind, "newent") == 0))
+	{
+	    e = add_edit(plan, strcmp(kind, "dirent") == 0
+			 ? PLAN_DIRENT : PLAN_NEWENT, cluster, slot);
+	    if (load_hex(oldhex, e->olddirent) && load_hex(newhex, e->newdirent))
+		continue;
+	}
+	fprintf(stderr, "plan: can't read line %d\n", lineno);
+	plan_free(plan);
+	return NULL;
+    }
+    return plan;
+}
+
+int plan_apply(struct repairplan *plan, struct dosimage *img)
+{
+    const struct dosgeom *geom = get_geometry(img);
+    struct planedit *e;
+    uint8_t *dirent;
+    uint32_t i, fatval;
+
+    if (plan->fattype != geom->fattype || plan->total_secs != geom->total_secs
+	|| plan->clust_size != geom->clust_size)
+    {
+	fprintf(stderr, "plan: made for a different volume\n");
+	return -1;
+    }
+    if (!sort_plan(plan, geom))
+	return -1;
+
+    /* everything is checked before anything is changed */
+    for (i = 0; i < plan->nedits; i++)
+    {
+	e = &plan->edits[i];
+	if (e->kind == PLAN_FAT)
+	{
+	    fatval = get_fat_entry(img, e->cluster);
+	    if (fatval != e->oldval)
+	    {
+		fprintf(stderr, "plan: FAT entry %u is %x, not %x\n",
+			e->cluster, fatval, e->oldval);
+		return -1;
+	    }
+	    continue;
+	}
+	dirent = cluster_to_addr(img, e->cluster) + e->slot * sizeof(struct direntry);
+	if (memcmp(dirent, e->olddirent, 32) != 0)
+	{
+	    fprintf(stderr, "plan: directory entry %u in cluster %u has changed\n",
+		    e->slot, e->cluster);
+	    return -1;
+	}
+    }
+
+    for (i = 0; i < plan->nedits; i++)
+    {
+	e = &plan->edits[i];
+	if (e->kind == PLAN_FAT)
+	{
+	    set_fat_entry(img, e->cluster, e->newval);
+	    continue;
+	}
+	dirent = cluster_for_write(img, e->cluster) + e->slot * sizeof(struct direntry);
+	memcpy(dirent, e->newdirent, 32);
+    }
+    return plan->nedits;
+}
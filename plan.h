@@ -0,0 +1,59 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* A repair plan is the list of changes a check wants to make to an
+   image, worked out without touching it.  Each edit carries the value
+   it expects to find as well as the one it writes, so a plan saved
+   with plan_save can be read over, and plan_apply refuses to apply it
+   to an image that has changed since. */
+
+struct dosimage;
+struct direntry;
+
+#define PLAN_FAT	1	/* set a FAT entry */
+#define PLAN_DIRENT	2	/* rewrite a directory entry */
+#define PLAN_NEWENT	3	/* fill an empty or deleted directory slot */
+
+struct planedit {
+    int kind;
+    uint32_t cluster;		/* the FAT entry, or the directory cluster
+				   (0 for the root directory) */
+    uint32_t slot;		/* entry within the directory cluster */
+    uint32_t oldval, newval;	/* PLAN_FAT: widened CLUST_* values */
+    uint8_t olddirent[32], newdirent[32];
+    uint64_t offset;		/* where in the image; set by sorting */
+    uint32_t seq;		/* order the edit was made in */
+};
+
+struct repairplan {
+    int fattype;		/* what the plan was made against */
+    uint32_t total_secs;
+    uint32_t clust_size;
+    uint32_t nedits, maxedits;
+    struct planedit *edits;
+};
+
+struct repairplan *plan_new(struct dosimage *);
+void plan_free(struct repairplan *);
+
+void plan_set_fat(struct repairplan *, uint32_t cluster,
+		  uint32_t oldval, uint32_t newval);
+void plan_dirent(struct repairplan *, uint32_t cluster, uint32_t slot,
+		 const struct direntry *olddirent,
+		 const struct direntry *newdirent);
+
+/* plan_save writes the plan as text, one edit per line in image
+   order; plan_load reads it back, returning NULL if it can't */
+void plan_save(struct repairplan *, struct dosimage *, FILE *);
+struct repairplan *plan_load(FILE *);
+
+/* plan_apply checks every edit against the image, then makes them all
+   in image order.  It returns the number of edits made, or -1 without
+   changing anything if the plan doesn't fit the image.  The changes
+   reach the file when the image is closed. */
+int plan_apply(struct repairplan *, struct dosimage *);
+
+#endif // __PLAN_H__
@@ -1,8 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include "direntry.h"
 #include "refc.h"
 //written by Bria Vicenti
-void node_init(struct node *n) {
-	n -> inDir = 0;
-    n -> type = -1;
-    n -> count = 0;
-    n -> dirint = -1;
+
+// rounds n up to a multiple of 8 bytes so each array stays aligned
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+struct reftable *refs_alloc(uint32_t nclusters) {
+    struct reftable *refs = malloc(sizeof(struct reftable));
+    size_t bitbytes = align8((nclusters + 63) / 64 * sizeof(uint64_t));
+    size_t typebytes = align8(nclusters);
+    size_t countbytes = align8(nclusters);
+    size_t dirintbytes = align8(nclusters * sizeof(int32_t));
+    size_t ownerbytes = align8(nclusters * sizeof(uint32_t));
+    uint8_t *p = malloc(bitbytes + typebytes + countbytes + dirintbytes + ownerbytes);
+
+    refs->nclusters = nclusters;
+    refs->arena = p;
+    refs->inDir = (uint64_t *)p;
+    p += bitbytes;
+    refs->type = (int8_t *)p;
+    p += typebytes;
+    refs->count = p;
+    p += countbytes;
+    refs->dirint = (int32_t *)p;
+    p += dirintbytes;
+    refs->owner = (uint32_t *)p;
+
+    // the same starting values node_init used to give each node
+    memset(refs->inDir, 0, bitbytes);
+    memset(refs->type, -1, nclusters);
+    memset(refs->count, 0, nclusters);
+    memset(refs->dirint, -1, nclusters * sizeof(int32_t));
+    memset(refs->owner, 0, nclusters * sizeof(uint32_t));
+
+    refs->owners = NULL;
+    refs->nowners = 0;
+    refs->maxowners = 0;
+    return refs;
+}
+
+void refs_free(struct reftable *refs) {
+    free(refs->arena);
+    free(refs->owners);
+    free(refs);
+}
+
+// records that the dirent in slot of dirCluster starts at cluster
+void ref_set_owner(struct reftable *refs, uint32_t cluster, 
+                   uint32_t dirCluster, uint32_t slot) {
+    if (refs->nowners == refs->maxowners) {
+        refs->maxowners = refs->maxowners ? refs->maxowners * 2 : 64;
+        refs->owners = realloc(refs->owners, refs->maxowners * sizeof(struct direntloc));
+    }
+    refs->owners[refs->nowners].cluster = dirCluster;
+    refs->owners[refs->nowners].slot = slot;
+    refs->nowners++;
+    refs->owner[cluster] = refs->nowners;
+}
+
+struct nameset *nameset_alloc(void) {
+    struct nameset *set = malloc(sizeof(struct nameset));
+    set->size = 256;
+    set->used = 0;
+    set->slots = calloc(set->size, sizeof(struct nameent));
+    return set;
+}
+
+void nameset_free(struct nameset *set) {
+    free(set->slots);
+    free(set);
+}
+
+// FNV-1a over the directory number and the case-folded name
+static uint32_t name_hash(int32_t dirint, const char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ ((uint32_t)dirint >> (8 * i) & 0xff)) * 16777619u;
+    }
+    for ( ; *name != '\0'; name++) {
+        h = (h ^ (uint8_t)toupper((uint8_t)*name)) * 16777619u;
+    }
+    return h;
+}
+
+// returns the slot holding this name, or the empty slot it would go in
+static struct nameent *name_slot(struct nameset *set, int32_t dirint, const char *name) {
+    uint32_t i = name_hash(dirint, name) & (set->size - 1);
+    while (set->slots[i].cluster != 0) {
+        if (set->slots[i].dirint == dirint && strcasecmp(set->slots[i].name, name) == 0) {
+            break;
+        }
+        i = (i + 1) & (set->size - 1);
+    }
+    return &set->slots[i];
+}
+
+// returns the start cluster of the file with this name in this
+// directory, or 0 if there isn't one
+uint32_t nameset_find(struct nameset *set, int32_t dirint, const char *name) {
+    return name_slot(set, dirint, name)->cluster;
+}
+
+void nameset_add(struct nameset *set, int32_t dirint, const char *name, uint32_t cluster) {
+    struct nameent *e;
+
+    // keep the table at most half full
+    if (2 * (set->used + 1) > set->size) {
+        struct nameent *old = set->slots;
+        uint32_t oldsize = set->size;
+        set->size *= 2;
+        set->used = 0;
+        set->slots = calloc(set->size, sizeof(struct nameent));
+        for (uint32_t i = 0; i < oldsize; i++) {
+            if (old[i].cluster != 0) {
+                nameset_add(set, old[i].dirint, old[i].name, old[i].cluster);
+            }
+        }
+        free(old);
+    }
+
+    e = name_slot(set, dirint, name);
+    if (e->cluster == 0) {
+        set->used++;
+    }
+    e->dirint = dirint;
+    e->cluster = cluster;
+    strncpy(e->name, name, sizeof(e->name) - 1);
+    e->name[sizeof(e->name) - 1] = '\0';
+}
+
+struct slotlist *slotlist_build(const struct direntry *dir, uint32_t nslots) {
+    struct slotlist *list = malloc(sizeof(struct slotlist));
+    list->slots = malloc((nslots ? nslots : 1) * sizeof(uint32_t));
+    list->count = 0;
+    list->next = 0;
+    int ended = 0;
+    for (uint32_t i = 0; i < nslots; i++) {
+        if (dir[i].deName[0] == SLOT_EMPTY)
+            ended = 1;
+        if (ended || dir[i].deName[0] == SLOT_DELETED)
+            list->slots[list->count++] = i;
+    }
+    return list;
+}
+
+void slotlist_free(struct slotlist *list) {
+    free(list->slots);
+    free(list);
+}
+
+int32_t slotlist_take(struct slotlist *list) {
+    if (list->next == list->count)
+        return -1;
+    return list->slots[list->next++];
 }
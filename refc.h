@@ -1,14 +1,80 @@
 #ifndef __REFC_H__
 #define __REFC_H__
 //written by Bria Vicenti
-struct node {
-	int inDir;
-    int type; // 0 -> empty; 1-> normal part of cluster chain; 2-> eof; 3-> bad; 4 -> reserved; -1 -> not set
-    char filename[128];
-    char dirint;
-    int count;
+#include <stdint.h>
+
+// where the dirent that owns a start cluster lives: slot number slot of
+// directory cluster cluster (cluster 0 is the fixed root directory)
+struct direntloc {
+    uint32_t cluster;
+    uint32_t slot;
+};
+
+// what scandisk knows about each cluster, one array per field so the
+// sweeps over all clusters stay cache friendly.  The arrays are carved
+// out of one allocation.
+struct reftable {
+    uint32_t nclusters;
+    uint64_t *inDir;     // bitset, set once the cluster is part of a directory's file
+    int8_t *type;        // 0 -> empty; 1-> normal part of cluster chain; 2-> eof; 3-> bad; 4 -> reserved; -1 -> not set
+    uint8_t *count;
+    int32_t *dirint;     // directory number of the owning dirent; -1 -> not set
+    uint32_t *owner;     // 1 + index into owners of the dirent that starts here; 0 -> none
+    struct direntloc *owners;
+    uint32_t nowners;
+    uint32_t maxowners;
+    void *arena;
+};
+
+struct reftable *refs_alloc(uint32_t nclusters);
+void refs_free(struct reftable *refs);
+void ref_set_owner(struct reftable *refs, uint32_t cluster, 
+                   uint32_t dirCluster, uint32_t slot);
+
+static inline int ref_inDir(struct reftable *refs, uint32_t cluster) {
+    return (refs->inDir[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+static inline void ref_set_inDir(struct reftable *refs, uint32_t cluster, int inDir) {
+    if (inDir)
+        refs->inDir[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+    else
+        refs->inDir[cluster / 64] &= ~((uint64_t)1 << (cluster % 64));
+}
+
+// the names already seen in each directory, so duplicates are found
+// with one lookup.  Keys are the case-folded "NAME.EXT" plus the
+// directory number; open addressing with linear probing.
+struct nameent {
+    int32_t dirint;
+    uint32_t cluster;    // start cluster of the file with this name; 0 -> empty slot
+    char name[13];
+};
+
+struct nameset {
+    uint32_t size;       // always a power of two
+    uint32_t used;
+    struct nameent *slots;
+};
+
+struct nameset *nameset_alloc(void);
+void nameset_free(struct nameset *set);
+uint32_t nameset_find(struct nameset *set, int32_t dirint, const char *name);
+void nameset_add(struct nameset *set, int32_t dirint, const char *name, uint32_t cluster);
+
+// the free slots of a directory, lowest first, so each new entry takes
+// one without rescanning: deleted entries before the end marker, then
+// every slot from the end marker on
+struct direntry;
+
+struct slotlist {
+    uint32_t *slots;
+    uint32_t count;
+    uint32_t next;       // index into slots of the next one to hand out
 };
 
-void node_init(struct node *n);
+struct slotlist *slotlist_build(const struct direntry *dir, uint32_t nslots);
+void slotlist_free(struct slotlist *list);
+int32_t slotlist_take(struct slotlist *list); // -1 -> directory full
 
 #endif // __REFC_H__
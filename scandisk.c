@@ -7,36 +7,121 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "dirscan.h"
+#include "plan.h"
+#include "fatgraph.h"
+#include "checkpoint.h"
+#include "log.h"
 #include "refc.c"
 
-static int dirint = 0;
+// everything about the image being checked is per thread, so a batch
+// can check one image on each of its threads
+static __thread int dirint = 0;
+static __thread struct freemap *freem; // free clusters, kept in step with the FAT
+static __thread struct nameset *names; // names seen so far in each directory
+static __thread struct dirscan *scan;   // every directory, read up front by dirscan_run
+static __thread struct repairplan *plan; // the fixes, made to the image once the checks are done
+static __thread struct fatgraph *graph; // chain lengths in the FAT as it was found
+static __thread struct checkpoint *lastClean; // the last clean check, when only what's changed since is checked
+static __thread struct checkpoint *thisCheck; // the image as this check found it
+static __thread uint64_t *dirtyFat; // clusters whose FAT sector has changed since lastClean
+static __thread struct logbuf out; // where the listing and the problems found go
+static __thread int issues; // problems found in the image
+static __thread int scanThreads; // threads for dirscan_run; 0 -> one per CPU
+static __thread FILE *findings; // with --check, where each problem goes as a JSON record
+static __thread const char *imageName; // the image being checked
+static __thread char dirPath[MAXPATHLEN + 1]; // the directory being walked, as "SRC/"
+static int checkOnly; // --check: find the problems and make no fixes
+static int logLevel = LOG_FINDINGS; // how much goes to out: -q, default, or -v
+
+// a check made with a checkpoint falls back to checking everything once
+// more than one FAT sector in this many has changed
+#define CHECKPOINT_FULL_SHARE 8
 
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--check | -q | -v] [-c checkpoint] [-p planfile | -a planfile] <imagename>\n", progname);
+    fprintf(stderr, "  --check       only report the problems, as JSON, one per line\n");
+    fprintf(stderr, "  -q            print nothing but errors\n");
+    fprintf(stderr, "  -v            list the whole directory tree as well as the problems\n");
+    fprintf(stderr, "  -c checkpoint only check what has changed since the last clean check,\n");
+    fprintf(stderr, "                and save a new checkpoint if this one is clean\n");
+    fprintf(stderr, "  -p planfile   check the image and save the fixes to planfile\n");
+    fprintf(stderr, "  -a planfile   make the fixes saved in planfile\n");
+    fprintf(stderr, "       %s [--check] -j threads [-l listfile] <imagename>...\n", progname);
+    fprintf(stderr, "  -j threads    check and fix many images at once, and print a summary\n");
+    fprintf(stderr, "                (0 threads -> one per CPU)\n");
+    fprintf(stderr, "  -l listfile   also check the images named in listfile, one per line\n");
     exit(1);
 }
 
+// writes s as a JSON string; anything outside printable ASCII is escaped
+void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for ( ; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
 
-// Modified by Sam Daulton, taken from is_valid_cluster in dos.c
-int is_valid_cluster_correct(uint16_t cluster, struct bpb33 *bpb)
-{
-    uint16_t max_cluster = bpb->bpbSectors - 1 - 9 - 9 - 14;
-    if (cluster >= (FAT12_MASK & CLUST_FIRST) && 
-        cluster <= (FAT12_MASK & CLUST_LAST) &&
-        cluster < max_cluster)
-        return TRUE;
-    return FALSE;
+// reports a problem found in the image.  With --check it becomes one
+// JSON record: what kind of problem, the cluster it's at, the path of
+// the file it's in (if name isn't NULL, name is in the directory being
+// walked), and what was expected and found (unless they're NOVALUE).
+// Otherwise the message is printed.
+#define NOVALUE (-1L)
+void issue(const char *type, uint32_t cluster, const char *name,
+           long expected, long actual, const char *fmt, ...) {
+    issues++;
+    if (findings == NULL) {
+        va_list ap;
+        va_start(ap, fmt);
+        log_vprintf(&out, LOG_FINDINGS, fmt, ap);
+        va_end(ap);
+        return;
+    }
+    fprintf(findings, "{\"image\":");
+    json_string(findings, imageName);
+    fprintf(findings, ",\"type\":\"%s\",\"cluster\":%u,\"path\":", type, cluster);
+    if (name != NULL) {
+        char path[MAXPATHLEN + MAXFILENAME + 1];
+        snprintf(path, sizeof(path), "%s%s", dirPath, name);
+        json_string(findings, path);
+    } else {
+        fprintf(findings, "null");
+    }
+    if (expected != NOVALUE) {
+        fprintf(findings, ",\"expected\":%ld", expected);
+    } else {
+        fprintf(findings, ",\"expected\":null");
+    }
+    if (actual != NOVALUE) {
+        fprintf(findings, ",\"actual\":%ld}\n", actual);
+    } else {
+        fprintf(findings, ",\"actual\":null}\n");
+    }
 }
 
+
 /* write the values into a directory entry -- taken from dos_cp.c */
 void write_dirent(struct direntry *dirent, char *filename, 
-          uint16_t start_cluster, uint32_t size)
+          uint32_t start_cluster, uint32_t size, struct dosimage *img)
 {
     char *p, *p2;
     char *uppername;
@@ -88,47 +173,63 @@ void write_dirent(struct direntry *dirent, char *filename,
 
     /* set the attributes and file size */
     dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
+    set_dirent_cluster(img, dirent, start_cluster);
     putulong(dirent->deFileSize, size);
 }
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry -- taken from dos_cp.c*/
-void create_dirent(struct direntry *dirent, char *filename, 
-           uint16_t start_cluster, uint32_t size,
-           uint8_t *image_buf, struct bpb33* bpb)
+/* create_dirent writes the directory entry into the next slot on the
+   directory's free list, and returns that slot, or -1 if the directory
+   is full -- taken from dos_cp.c */
+int create_dirent(struct direntry *dir, int nslots, struct slotlist *freeSlots,
+           char *filename, uint32_t start_cluster, uint32_t size, struct dosimage *img)
 {
-    while (1) 
-    {
-    if (dirent->deName[0] == SLOT_EMPTY) 
+    int32_t slot = slotlist_take(freeSlots);
+    if (slot < 0)
     {
-        /* we found an empty slot at the end of the directory */
-        write_dirent(dirent, filename, start_cluster, size);
-        dirent++;
-
-        /* make sure the next dirent is set to be empty, just in
-           case it wasn't before */
-        memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-        dirent->deName[0] = SLOT_EMPTY;
-        return;
+    return -1;
     }
 
-    if (dirent->deName[0] == SLOT_DELETED) 
+    struct direntry *dirent = dir + slot;
+    int atEnd = dirent->deName[0] == SLOT_EMPTY;
+    write_dirent(dirent, filename, start_cluster, size, img);
+
+    /* if this was the end of the directory, make sure the next dirent
+       is set to be empty, just in case it wasn't before */
+    if (atEnd && slot + 1 < nslots)
     {
-        /* we found a deleted entry - we can just overwrite it */
-        write_dirent(dirent, filename, start_cluster, size);
-        return;
-    }
     dirent++;
+    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
+    dirent->deName[0] = SLOT_EMPTY;
     }
+    return slot;
+}
+
+// returns the directory entry at slot in a directory cluster (0 for the
+// root) as the scan copied it; the checks edit the copy and the walk
+// adds what changed to the plan.  A cluster the scan never reached is
+// read from the image into a spare copy.
+struct direntry *get_dirent(struct dosimage *img, uint32_t cluster, uint32_t slot) {
+    static __thread struct direntry spare;
+    struct direntry *dirent = dirscan_entry(scan, cluster, slot);
+    if (dirent == NULL) {
+        spare = *((struct direntry*)cluster_to_addr(img, cluster) + slot);
+        dirent = &spare;
+    }
+    return dirent;
+}
+
+// the checks change the FAT only through set_fat, so each change is in
+// the plan; the image is open read-only, and keeps the change in memory
+// for the checks that follow
+void set_fat(struct dosimage *img, uint32_t cluster, uint32_t value) {
+    plan_set_fat(plan, cluster, get_fat_entry(img, cluster), value);
+    set_fat_entry(img, cluster, value);
 }
 
 // Taken from dos_ls.c
 void print_indent(int indent)
 {
-    int i;
-    for (i = 0; i < indent*4; i++)
-        printf(" ");
+    log_indent(&out, LOG_TREE, indent*4);
 }
 
 // From dos_ls.c
@@ -187,15 +288,18 @@ int get_name(char *fullname, struct direntry *dirent)
 
 
 // modified by Sam Daulton & Bria Vicenti from dos_ls.c
-uint16_t print_dirent(struct direntry *dirent, int indent, int thisDirint)
+// quiet leaves the entry out of the listing, as does a log that isn't
+// keeping the tree, and then nothing is formatted
+uint32_t print_dirent(struct direntry *dirent, int indent, int thisDirint, int quiet,
+                      struct dosimage *img)
 {
-    uint16_t followclust = 0;
+    uint32_t followclust = 0;
     
     int i;
     char name[9];
     char extension[4];
     uint32_t size;
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
@@ -217,6 +321,7 @@ uint16_t print_dirent(struct direntry *dirent, int indent, int thisDirint)
         // skip it
         return followclust;
     }
+    quiet = quiet || !log_wants(&out, LOG_TREE);
     
     /* names are space padded - remove the spaces */
     for (i = 8; i > 0; i--)
@@ -244,7 +349,8 @@ uint16_t print_dirent(struct direntry *dirent, int indent, int thisDirint)
     }
     else if ((dirent->deAttributes & ATTR_VOLUME) != 0)
     {
-        printf("Volume: %s\n", name);
+        if (!quiet)
+            log_printf(&out, LOG_TREE, "Volume: %s\n", name);
     }
     else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
     {
@@ -252,10 +358,12 @@ uint16_t print_dirent(struct direntry *dirent, int indent, int thisDirint)
         // for trash directories and such; just ignore them.
         if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
-            print_indent(indent);
             dirint++;
-            printf("%s/ (in directory #%d)\n", name, thisDirint);
-            file_cluster = getushort(dirent->deStartCluster);
+            if (!quiet) {
+                print_indent(indent);
+                log_printf(&out, LOG_TREE, "%s/ (in directory #%d)\n", name, thisDirint);
+            }
+            file_cluster = dirent_cluster(img, dirent);
             followclust = file_cluster;
         }
     }
@@ -271,10 +379,12 @@ uint16_t print_dirent(struct direntry *dirent, int indent, int thisDirint)
         int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
         
         size = getulong(dirent->deFileSize);
+        if (quiet)
+            return followclust;
         print_indent(indent);
 
-        printf("%s.%s (%u bytes) (starting cluster %d) (in directory %d) %c%c%c%c\n",
-               name, extension, size, getushort(dirent->deStartCluster), thisDirint,
+        log_printf(&out, LOG_TREE, "%s.%s (%u bytes) (starting cluster %u) (in directory %d) %c%c%c%c\n",
+               name, extension, size, dirent_cluster(img, dirent), thisDirint,
                ro?'r':' ',
                hidden?'h':' ',
                sys?'s':' ',
@@ -363,28 +473,34 @@ uint16_t is_file(struct direntry *dirent, int indent)
 
 // Written by Sam Daulton
 // returns an integer representing the cluster type, used in the cluster references data strucutre
-int get_cluster_type(uint16_t clusterNum, uint8_t *image_buf, struct bpb33* bpb) {
-    uint16_t fatEntry = get_fat_entry(clusterNum, image_buf, bpb);
-    if (fatEntry >= (FAT12_MASK & CLUST_FIRST) && fatEntry <= (FAT12_MASK & CLUST_LAST)) {
+int get_cluster_type(uint32_t clusterNum, struct dosimage *img) {
+    uint32_t fatEntry = get_fat_entry(img, clusterNum);
+    if (fatEntry >= CLUST_FIRST && fatEntry <= CLUST_LAST) {
         return 1;
     } else if (is_end_of_file(fatEntry)) {
         return 2;
-    } else if (fatEntry == (FAT12_MASK & CLUST_BAD)) {
+    } else if (fatEntry == CLUST_BAD) {
         return 3;
-    } else if (fatEntry >= (FAT12_MASK & CLUST_RSRVDS) &&
-                             fatEntry <= (FAT12_MASK & CLUST_RSRVDE)) {
+    } else if (fatEntry >= CLUST_RSRVDS && fatEntry <= CLUST_RSRVDE) {
         return 4;
-    } else if (fatEntry == (FAT12_MASK & CLUST_FREE)) {
+    } else if (fatEntry == CLUST_FREE) {
         return 0;
     } else {
-        printf("Error setting cluster type for cluster number %d\n", clusterNum);
+        issue("bad_fat_entry", clusterNum, NULL, NOVALUE, fatEntry,
+              "Error setting cluster type for cluster number %d\n", clusterNum);
         return -1;
     }
 }
 
+// marks a cluster free in the FAT and returns it to the free map
+void free_cluster(struct dosimage *img, uint32_t cluster) {
+    set_fat(img, cluster, CLUST_FREE);
+    freemap_release(freem, cluster);
+}
+
 //Written by Sam Daulton -- features code from print_dirent in dos_ls.c
 //fix the cluster already used in a cluster chain (either this file or another file) -->truncate this file to end at the cluster preceding the already used cluster
-void fixUsedCluster(uint16_t prevCluster, uint16_t nextCluster, uint8_t *image_buf, struct bpb33* bpb, struct node *references[], struct direntry *dirent) {
+void fixUsedCluster(uint32_t prevCluster, uint32_t nextCluster, struct dosimage *img, struct reftable *references, struct direntry *dirent) {
     char name[9];
     // already in the cluster chain of another dirent
     // set prevCluster in chain as EOF
@@ -398,52 +514,61 @@ void fixUsedCluster(uint16_t prevCluster, uint16_t nextCluster, uint8_t *image_b
         else
             break;
     }
-    printf("Cluster Number %d is already part of cluster chain.  So file %s was truncated to end at the cluster preceding %d\n", nextCluster, name, nextCluster);
-    references[prevCluster]->type = 2;
-    set_fat_entry(prevCluster, (FAT12_MASK & CLUST_EOFS), image_buf, bpb);
+    char fullname[128] = "";
+    get_name(fullname, dirent);
+    issue("cross_linked", nextCluster, fullname, NOVALUE, NOVALUE,
+          "Cluster Number %d is already part of cluster chain.  So file %s was truncated to end at the cluster preceding %d\n", nextCluster, name, nextCluster);
+    references->type[prevCluster] = 2;
+    set_fat(img, prevCluster, CLUST_EOFS);
 }
 
 
 //Written by Sam Daulton
 // Takes the start cluster number as a parameter and returns the length of the cluster chain (i.e. number of clusters in file)
-int get_chain_length(uint16_t startCluster, uint8_t *image_buf, struct bpb33* bpb, struct node *references[], struct direntry *dirent) {
+int get_chain_length(uint32_t startCluster, struct dosimage *img, struct reftable *references, struct direntry *dirent) {
     int numClusters = 1;
-    uint16_t nextCluster = get_fat_entry(startCluster, image_buf, bpb);
-    uint16_t prevCluster = startCluster;
-    uint16_t beforePrevCluster = startCluster;
-    while (is_valid_cluster_correct(nextCluster, bpb)) {
-		if (references[nextCluster]->inDir) {
-        	fixUsedCluster(prevCluster, nextCluster, image_buf, bpb, references, dirent);
-        	return numClusters;
-        }
-            
-        references[nextCluster]->inDir = 1;
-        references[nextCluster]->count = 1;
-        references[nextCluster]->type = get_cluster_type(nextCluster, image_buf, bpb);
+    uint32_t prevCluster = startCluster;
+    uint32_t beforePrevCluster = startCluster;
+    // follow the chain one FAT entry at a time; check_size has already
+    // dealt with the start cluster.  Every cluster is marked as it is
+    // reached, so the walk stops at the first cluster another file has,
+    // and a chain that loops stops where it comes back round.
+    uint32_t nextCluster = get_fat_entry(img, startCluster);
+    while (is_valid_cluster(img, nextCluster)) {
+        if (ref_inDir(references, nextCluster)) {
+            fixUsedCluster(prevCluster, nextCluster, img, references, dirent);
+            return numClusters;
+        }
+
+        ref_set_inDir(references, nextCluster, 1);
+        references->count[nextCluster] = 1;
+        references->type[nextCluster] = get_cluster_type(nextCluster, img);
         beforePrevCluster = prevCluster;
         prevCluster = nextCluster;
-        nextCluster = get_fat_entry(nextCluster, image_buf, bpb);
         numClusters++;
-        
+        nextCluster = get_fat_entry(img, nextCluster);
     }
-    if (get_cluster_type(prevCluster, image_buf, bpb) == 3) {
+    if (get_cluster_type(prevCluster, img) == 3) {
             // nextCluster is bad
             // set previous to EOF
             // free next cluster
             // NOTE rest of chain still exists, we will make them orphans if they are valid fat entries.
             // If they we find a "bad orphan" we will free it.
-            printf("Bad cluster: number: %d.  File truncated to cluster before bad cluster (now file size is %d bytes)\n", prevCluster, numClusters * 512);
-            set_fat_entry(beforePrevCluster, (FAT12_MASK & CLUST_EOFS), image_buf, bpb);
-            references[prevCluster]->inDir = 0;
-            references[prevCluster]->type = 0;
-            set_fat_entry(prevCluster, CLUST_FREE, image_buf, bpb);
-            references[beforePrevCluster]->type = 2;
+            char name[128] = "";
+            get_name(name, dirent);
+            issue("bad_cluster", prevCluster, name, NOVALUE, NOVALUE,
+                  "Bad cluster: number: %d.  File truncated to cluster before bad cluster (now file size is %d bytes)\n", prevCluster, numClusters * get_geometry(img)->clust_size);
+            set_fat(img, beforePrevCluster, CLUST_EOFS);
+            ref_set_inDir(references, prevCluster, 0);
+            references->type[prevCluster] = 0;
+            free_cluster(img, prevCluster);
+            references->type[beforePrevCluster] = 2;
             return numClusters-1;
         } else if (nextCluster == 0) {
             //Empty
-            references[prevCluster]->inDir = 1;
-            references[prevCluster]->type = 2;
-            set_fat_entry(prevCluster, (FAT12_MASK & CLUST_EOFS), image_buf, bpb);
+            ref_set_inDir(references, prevCluster, 1);
+            references->type[prevCluster] = 2;
+            set_fat(img, prevCluster, CLUST_EOFS);
             return numClusters+1;
         }
 
@@ -452,14 +577,13 @@ int get_chain_length(uint16_t startCluster, uint8_t *image_buf, struct bpb33* bp
 
 // Writen By Bria Vicenti
 // checks if a direntry is valid. 0 if yes, -1 if no.
-int is_valid_dir(struct direntry *dirent) {
+int is_valid_dir(struct dosimage *img, struct direntry *dirent) {
     int valid = 0;
     uint32_t size = getulong(dirent->deFileSize);
-    uint16_t startCluster = getushort(dirent->deStartCluster);
+    uint32_t startCluster = dirent_cluster(img, dirent);
 
     // check 1: is the startcluster in a valid range?
-    if (startCluster < 2 || startCluster > (FAT12_MASK & CLUST_EOFE) || 
-                                                startCluster == ((FAT12_MASK & CLUST_BAD)) ) {
+    if (!is_valid_cluster(img, startCluster)) {
         valid = -1;
     }
     // check 2: is the size valid?
@@ -472,18 +596,18 @@ int is_valid_dir(struct direntry *dirent) {
 // Written By Bria Vicenti
 // given duplicate clusters n1 & n2, resolves it. 
 // returns 0 if not deleted, return 1 if direntry deleted
-int duplicate_fixer(uint8_t *image_buf, struct bpb33* bpb, struct node *references[], 
+int duplicate_fixer(struct dosimage *img, struct reftable *references, 
                                                                         int dup, struct direntry *dirent) 
 {
     char newName[128];
     
-    if (is_valid_dir(dirent) == -1) {
+    if (is_valid_dir(img, dirent) == -1) {
         dirent->deName[0] = SLOT_DELETED;
-        printf("Duplicate is corrupt! Deleting now.\n");
+        log_printf(&out, LOG_FINDINGS, "Duplicate is corrupt! Deleting now.\n");
         return 1;
     }
     
-    printf("Two valid duplicates found! Scandisk will save one as a copy.\n");
+    log_printf(&out, LOG_FINDINGS, "Two valid duplicates found! Scandisk will save one as a copy.\n");
     get_name(newName, dirent);
     char *p = strchr(newName, '.');
     strcpy(p, "2\0"); // Adds "2" to mark the duplicate and gets rid of the extension
@@ -492,139 +616,226 @@ int duplicate_fixer(uint8_t *image_buf, struct bpb33* bpb, struct node *referenc
 }
 
 // Written by Bria Vicenti
-// Given a filename, checks for a duplicate of that filename and returns the clust. #
-// if it exists.
-int duplicate_finder(struct node* references[], char* filename, int numDataClusters, int n) {
-    for (int i = 2; i < numDataClusters; i++) {
-        if (strlen(filename) < 1) {
-            return 0;
-        }
-        else if (strlen(references[i]->filename) < 1) {
-            continue;
+// Given a filename, checks for a duplicate of that filename in the same
+// directory and returns the clust. # of the file that already has it, if
+// there is one.  Names are looked up in the directory name set, which
+// check_size fills as it goes.
+int duplicate_finder(char* filename, int thisDirint) {
+    uint32_t dup;
+    if (strlen(filename) < 1) {
+        return 0;
+    }
+    dup = nameset_find(names, thisDirint, filename);
+    if (dup != 0) {
+        issue("duplicate_name", dup, filename, NOVALUE, NOVALUE,
+              "Duplicate found! There are two files named '%s'.\n", filename);
+    }
+    return dup;
+}
+
+// Written by Bria Vicenti
+// follows an orphan chain from start through the orphans nobody has
+// claimed yet, claiming them, and returns how many clusters it has;
+// the chain ends early at a bad cluster, which is freed
+int claim_orphan_chain(struct dosimage *img, struct reftable *references,
+                       uint64_t *orphans, uint32_t start, uint32_t *last,
+                       int maxCluster)
+{
+    int length = 1;
+    uint32_t cluster = start;
+    orphans[start / 64] &= ~((uint64_t)1 << (start % 64));
+    ref_set_inDir(references, start, 1);
+    references->type[start] = 1;
+
+    while (1) {
+        uint32_t next = get_fat_entry(img, cluster);
+        if (next < CLUST_FIRST || next >= maxCluster ||
+            (orphans[next / 64] & ((uint64_t)1 << (next % 64))) == 0) {
+            break;
         }
-        if (strcasecmp(filename, references[i]->filename) == 0) {
-            if ((references[i]->dirint != references[n]->dirint) ||(references[i]->dirint == -1)||(references[n]->dirint == -1)) {
-                // The two files are named the same but are in different directories.
-                return 0;
-            }
-            printf("Duplicate found! There are two files named '%s'.\n", filename);
-            return i;
+        orphans[next / 64] &= ~((uint64_t)1 << (next % 64));
+        if (get_fat_entry(img, next) == CLUST_BAD) {
+            issue("bad_orphan", next, NULL, NOVALUE, NOVALUE,
+                  "Bad Orphan found! Cluster #%d. Fat Entry set to free.\n", next);
+            free_cluster(img, next);
+            break;
         }
+        ref_set_inDir(references, next, 1);
+        references->type[next] = 1;
+        cluster = next;
+        length++;
     }
-    return 0;
+    *last = cluster;
+    return length;
 }
 
 // Written by Bria Vicenti
-// detects and fixes any orphan clusters
-void orphan_fixer(uint8_t *image_buf, struct bpb33* bpb, struct node *references[], 
-                                                int numDataClusters) 
+// detects and fixes any orphan clusters.  The orphans are put back
+// together into the chains they came from, and each chain is saved as
+// one file in the root directory.
+void orphan_fixer(struct dosimage *img, struct reftable *references, 
+                                                int maxCluster) 
 {
-    int numClusters = 1;
     char name[64];
     char num[32];
     int orphanNum = 1;
-    uint16_t nextCluster;
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(0, image_buf, bpb);
-    int clustType = 0;
-
-    for (int i = 2; i < numDataClusters; i++) {
-        nextCluster = get_fat_entry(i, image_buf, bpb);        
-        clustType = get_cluster_type(i, image_buf, bpb);
-
-        if (nextCluster != (FAT12_MASK&CLUST_FREE) && references[i]->inDir == 0) {
-            //orphan
-            if (nextCluster == (FAT12_MASK & CLUST_BAD)) {
-                //bad orphan
-                //free it
-                printf("Bad Orphan found! Cluster #%d. Fat Entry set to free.\n", i);
-                set_fat_entry(nextCluster, CLUST_FREE, image_buf, bpb);
-                continue;
-            }
-            printf("Orphan #%d found! Cluster #%d.\n", orphanNum, i);
-            sprintf(num, "%d", orphanNum); // Converts to string so we can concat.
-            strcpy(name, "found");
-            strcat(name, num);
-            strcat(name, ".dat");
-
-            create_dirent(dirent, name, i, numClusters * 512, image_buf, bpb);
-            int dup = 0;
-            dup = duplicate_finder(references, name, numDataClusters, i); // check for duplicates
-            if (dup != 0) {
-                duplicate_fixer(image_buf, bpb, references, dup, dirent); // fix
-            }
 
-            numClusters = 1;
-            orphanNum++;
-            references[i]->inDir = 1;
-            //references[i]->dirint = 0;
+    // the new entries go into the scan's copy of the root directory,
+    // and whatever changed there is added to the plan at the end
+    const struct dosgeom *geom = get_geometry(img);
+    int rootSlots = geom->fattype == 32 ? geom->clust_size / sizeof(struct direntry)
+                                        : geom->root_ents;
+    struct direntry *dirent = get_dirent(img, 0, 0);
+    struct direntry *before = malloc(rootSlots * sizeof(struct direntry));
+    memcpy(before, dirent, rootSlots * sizeof(struct direntry));
+    struct slotlist *freeSlots = slotlist_build(dirent, rootSlots);
 
-            // set type to eof
-            // i.e. make the orphan cluster a standalone data file
-            set_fat_entry(i, (FAT12_MASK & CLUST_EOFS), image_buf, bpb);
-            references[i]->type = 2;
-            printf("Orphan fixed!\n");
+    // an orphan is a cluster in use that no file reached, so one pass
+    // over the free map and the reference bitset finds all of them,
+    // and only those clusters are looked at after that
+    uint32_t nwords = (maxCluster + 63) / 64;
+    uint64_t *orphans = calloc(nwords, sizeof(uint64_t));
+    freemap_in_use(freem, references->inDir, orphans, maxCluster);
+
+    // a chain starts at an orphan that no other orphan points to
+    uint64_t *heads = malloc(nwords * sizeof(uint64_t));
+    memcpy(heads, orphans, nwords * sizeof(uint64_t));
+    for (uint32_t w = 0; w < nwords; w++) {
+        uint64_t bits = orphans[w];
+        while (bits != 0) {
+            uint32_t next = get_fat_entry(img, w * 64 + __builtin_ctzll(bits));
+            bits &= bits - 1;
+            if (next >= CLUST_FIRST && next < maxCluster)
+                heads[next / 64] &= ~((uint64_t)1 << (next % 64));
         }
     }
+
+    // first every chain with a head, then whatever is left, which can
+    // only be loops; each loop is cut where it comes back round
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t *starts = pass == 0 ? heads : orphans;
+        for (uint32_t w = 0; w < nwords; w++) {
+            while ((starts[w] & orphans[w]) != 0) {
+                uint32_t i = w * 64 + __builtin_ctzll(starts[w] & orphans[w]);
+                if (get_fat_entry(img, i) == CLUST_BAD) {
+                    //bad orphan
+                    //free it
+                    issue("bad_orphan", i, NULL, NOVALUE, NOVALUE,
+                          "Bad Orphan found! Cluster #%d. Fat Entry set to free.\n", i);
+                    orphans[w] &= ~((uint64_t)1 << (i % 64));
+                    free_cluster(img, i);
+                    continue;
+                }
+
+                uint32_t last;
+                int length = claim_orphan_chain(img, references, orphans, i, &last, maxCluster);
+                if (length == 1)
+                    issue("orphan", i, NULL, NOVALUE, length,
+                          "Orphan #%d found! Cluster #%d.\n", orphanNum, i);
+                else
+                    issue("orphan", i, NULL, NOVALUE, length,
+                          "Orphan #%d found! Cluster #%d starts a chain of %d clusters.\n",
+                           orphanNum, i, length);
+                sprintf(num, "%d", orphanNum); // Converts to string so we can concat.
+                strcpy(name, "found");
+                strcat(name, num);
+                strcat(name, ".dat");
+                orphanNum++;
+
+                int slot = create_dirent(dirent, rootSlots, freeSlots, name, i,
+                                         length * geom->clust_size, img);
+                if (slot < 0) {
+                    log_printf(&out, LOG_FINDINGS, "The root directory is full, so orphan #%d was left alone.\n", orphanNum - 1);
+                    continue;
+                }
+                int dup = 0;
+                dup = duplicate_finder(name, 0); // check for duplicates in the root directory
+                if (dup != 0) {
+                    duplicate_fixer(img, references, dup, &dirent[slot]); // fix
+                }
+
+                // end the chain where the orphans run out
+                set_fat(img, last, CLUST_EOFS);
+                references->type[last] = 2;
+                log_printf(&out, LOG_FINDINGS, "Orphan fixed!\n");
+            }
+        }
+    }
+    free(heads);
+    free(orphans);
+    slotlist_free(freeSlots);
+
+    for (int slot = 0; slot < rootSlots; slot++) {
+        if (memcmp(&before[slot], &dirent[slot], sizeof(struct direntry)) != 0) {
+            plan_dirent(plan, 0, slot, &before[slot], &dirent[slot]);
+        }
+    }
+    free(before);
 }
 
 // Written by Bria Vicenti
 // fixes the situation where a FAT chain is shorter than the expected filesize
-void dir_entry_fixer(struct direntry *dirent, int chainLength) {
-    uint32_t size = chainLength * 512;
+void dir_entry_fixer(struct direntry *dirent, int chainLength, struct dosimage *img) {
+    uint32_t size = chainLength * get_geometry(img)->clust_size;
     putulong(dirent->deFileSize, size);
 }
 
 // Written by Bria Vicenti,
 // fixes the situation where a FAT chain is longer than the correct file size
-void fat_chain_fixer(uint16_t startCluster, uint8_t *image_buf, struct bpb33* bpb, uint32_t expectedChainLength, struct node *references[]) {
+void fat_chain_fixer(uint32_t startCluster, struct dosimage *img, uint32_t expectedChainLength, struct reftable *references) {
     int currentNum = 1;
-    uint16_t prevCluster = startCluster;
-    uint16_t nextCluster = get_fat_entry(startCluster, image_buf, bpb);
+    uint32_t prevCluster = startCluster;
+    uint32_t nextCluster = get_fat_entry(img, startCluster);
+    // the chain can't be longer than it was in the graph, so neither
+    // loop below can go round forever
+    uint32_t left = fatgraph_length(graph, startCluster);
     
     // cycle through the chain until the stopping point
-    while (currentNum < expectedChainLength) {
+    while (currentNum < expectedChainLength && currentNum < left) {
         prevCluster = nextCluster;
-        nextCluster = get_fat_entry(nextCluster, image_buf, bpb);
+        nextCluster = get_fat_entry(img, nextCluster);
         currentNum++;
     }
     
-    // free any clusters past the correct size
-    if (is_valid_cluster_correct(nextCluster,bpb)) {
-    	while (!is_end_of_file(get_fat_entry(nextCluster, image_buf, bpb))) {
+    // free any clusters past the correct size, up to the last one in
+    // the chain
+    if (is_valid_cluster(img, nextCluster)) {
+    	while (++currentNum < left && is_valid_cluster(img, get_fat_entry(img, nextCluster))) {
         	
-            uint16_t toFree = nextCluster;
+            uint32_t toFree = nextCluster;
 
         	//update references
-        	references[nextCluster]->inDir = 0;
-        	references[nextCluster]->type = 0;
-        	nextCluster = get_fat_entry(nextCluster, image_buf, bpb);
-        	set_fat_entry(toFree, CLUST_FREE, image_buf, bpb);
+        	ref_set_inDir(references, nextCluster, 0);
+        	references->type[nextCluster] = 0;
+        	nextCluster = get_fat_entry(img, nextCluster);
+        	free_cluster(img, toFree);
     	}
     
 
     	// frees the old EOF
-    	references[nextCluster]->inDir = 0;
-    	references[nextCluster]->type = 0;
-    	set_fat_entry(nextCluster, CLUST_FREE, image_buf, bpb);
+    	ref_set_inDir(references, nextCluster, 0);
+    	references->type[nextCluster] = 0;
+    	free_cluster(img, nextCluster);
     }
     // set the new last cluster to EOF
-    set_fat_entry(prevCluster, (FAT12_MASK & CLUST_EOFS), image_buf, bpb);
+    set_fat(img, prevCluster, CLUST_EOFS);
 
     //update references
-    references[prevCluster]->type = 2;
-    references[prevCluster]->inDir = 1;
-    prevCluster = get_fat_entry(prevCluster, image_buf, bpb);
+    references->type[prevCluster] = 2;
+    ref_set_inDir(references, prevCluster, 1);
+    prevCluster = get_fat_entry(img, prevCluster);
 }
 
 // Written by Sam Daulton
 //function that checks the size of the dirent compared to the length of the cluster chain and calls the appropriate fixer function if inconsistent
-void check_size(struct direntry* dirent, uint8_t *image_buf, struct bpb33* bpb, struct node *references[], int numDataClusters, int thisDirint) {
+void check_size(struct direntry* dirent, struct dosimage *img, struct reftable *references, int maxCluster, int thisDirint,
+                uint32_t dirCluster, uint32_t slot) {
     uint32_t size = 0;
-    uint16_t startCluster = 0;
+    uint32_t startCluster = 0;
     uint32_t expectedChainLength = 0;
     int chainLength = 0;
     size = getulong(dirent->deFileSize);
-    startCluster = getushort(dirent->deStartCluster);
+    startCluster = dirent_cluster(img, dirent);
     int dup = 0;	
     
     // update cluster references
@@ -634,134 +845,655 @@ void check_size(struct direntry* dirent, uint8_t *image_buf, struct bpb33* bpb,
     }
     
     //check if start cluster is valid
-	if (!is_valid_cluster_correct(startCluster, bpb)) {
+	if (!is_valid_cluster(img, startCluster)) {
         // start cluster num is not valid
-         printf("Start Cluster Number %d is not valid.  So file %s was deleted\n", startCluster, name);
+         issue("bad_start_cluster", startCluster, name, NOVALUE, startCluster,
+               "Start Cluster Number %d is not valid.  So file %s was deleted\n", startCluster, name);
         dirent->deName[0] = SLOT_DELETED;
         return;
     }
 
-    dup = duplicate_finder(references, name, numDataClusters, startCluster); // check for duplicates & fix
+    dup = duplicate_finder(name, thisDirint); // check for duplicates & fix
     if (dup != 0) {
-        duplicate_fixer(image_buf, bpb, references, dup, dirent);
+        duplicate_fixer(img, references, dup, dirent);
         return; // Just stop the operation because this direntry is no longer relevant.
     }
 
-    strcpy(references[startCluster]->filename, name);
+    ref_set_owner(references, startCluster, dirCluster, slot);
+    nameset_add(names, thisDirint, name, startCluster);
 
-    if (references[startCluster]->inDir) {
-        printf("Start Cluster Number %d is already part of cluster chain.  So file %s was deleted\n", startCluster, name);
+    if (ref_inDir(references, startCluster)) {
+        issue("start_cluster_in_use", startCluster, name, NOVALUE, NOVALUE,
+              "Start Cluster Number %d is already part of cluster chain.  So file %s was deleted\n", startCluster, name);
         dirent->deName[0] = SLOT_DELETED;
         return;
     } else {
-        references[startCluster]->inDir = 1;
-        references[startCluster]->dirint = thisDirint;
-        references[startCluster]->type = get_cluster_type(startCluster, image_buf, bpb);
+        ref_set_inDir(references, startCluster, 1);
+        references->dirint[startCluster] = thisDirint;
+        references->type[startCluster] = get_cluster_type(startCluster, img);
     }
 
     // check that length of cluster chain == size
     // this also checks if any clusters in this dirent's cluster chain are already part of a cluster chain.
-    chainLength = get_chain_length(startCluster, image_buf, bpb, references, dirent);
+    chainLength = get_chain_length(startCluster, img, references, dirent);
     // ceiling division
-    expectedChainLength = (size % 512) ? (size / 512 + 1) : (size / 512);
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+        // a directory's size is always 0; it's as long as its chain,
+        // which can run to more than one cluster
+        return;
+    }
+    uint32_t clustSize = get_geometry(img)->clust_size;
+    expectedChainLength = (size % clustSize) ? (size / clustSize + 1) : (size / clustSize);
     if (expectedChainLength == 0) {
-        // directories have expected length 0 clusters, but they still use 1
+        // an empty file still has its start cluster
         expectedChainLength = 1;
     }
     if (chainLength != expectedChainLength) {
-        printf("INCONSISTENCY: expected chain length (%u clusters) does not match length of cluster chain (%d clusters)\n", expectedChainLength, chainLength);
+        issue("size_mismatch", startCluster, name, expectedChainLength, chainLength,
+              "INCONSISTENCY: expected chain length (%u clusters) does not match length of cluster chain (%d clusters)\n", expectedChainLength, chainLength);
         if (chainLength > expectedChainLength) {
-            fat_chain_fixer(startCluster, image_buf, bpb, expectedChainLength, references);
-            printf("Inconsistency now fixed.\n");
+            fat_chain_fixer(startCluster, img, expectedChainLength, references);
+            log_printf(&out, LOG_FINDINGS, "Inconsistency now fixed.\n");
         }
         else {
-            dir_entry_fixer(dirent, chainLength);
-            printf("Inconsistency now fixed.\n");
+            dir_entry_fixer(dirent, chainLength, img);
+            log_printf(&out, LOG_FINDINGS, "Inconsistency now fixed.\n");
+        }
+    }
+}
+
+// true unless the directory cluster is just as it was at the last clean
+// check; without a checkpoint every cluster counts as changed
+int dir_changed(uint32_t cluster) {
+    return lastClean == NULL || checkpoint_dir_changed(lastClean, thisCheck, cluster);
+}
+
+// an entry in an unchanged directory cluster, whose chain only runs
+// through unchanged FAT sectors, passed the last clean check and still
+// does, as long as no file checked before it has taken any of its
+// clusters or its name.  Such an entry is only recorded, the way
+// check_size records a good one, and 1 is returned; anything else is
+// left for check_size.
+int claim_clean_entry(struct dosimage *img, struct reftable *references,
+                      struct direntry *dirent, int thisDirint,
+                      uint32_t dirCluster, uint32_t slot) {
+    char name[128];
+    if (get_name(name, dirent) == -1) {
+        // check_size has nothing to check either
+        return 1;
+    }
+    uint32_t startCluster = dirent_cluster(img, dirent);
+    if (!is_valid_cluster(img, startCluster) || nameset_find(names, thisDirint, name) != 0) {
+        return 0;
+    }
+
+    // the whole chain is looked at before any of it is claimed
+    uint32_t length = fatgraph_length(graph, startCluster);
+    uint32_t cluster = startCluster;
+    uint32_t n = 0;
+    while (n < length && is_valid_cluster(img, cluster)) {
+        if (((dirtyFat[cluster / 64] >> (cluster % 64)) & 1) || ref_inDir(references, cluster)) {
+            return 0;
         }
+        n++;
+        cluster = get_fat_entry(img, cluster);
+    }
+    if (n < length || !is_end_of_file(cluster)) {
+        return 0;
     }
+
+    ref_set_owner(references, startCluster, dirCluster, slot);
+    nameset_add(names, thisDirint, name, startCluster);
+    references->dirint[startCluster] = thisDirint;
+    cluster = startCluster;
+    for (n = 0; n < length; n++) {
+        ref_set_inDir(references, cluster, 1);
+        if (n > 0) {
+            references->count[cluster] = 1;
+        }
+        references->type[cluster] = get_cluster_type(cluster, img);
+        cluster = get_fat_entry(img, cluster);
+    }
+    return 1;
+}
+
+// adds a directory entry's name to dirPath before walking into it, and
+// returns the length to cut dirPath back to afterwards
+size_t enter_dir(struct direntry *dirent) {
+    size_t len = strlen(dirPath);
+    char name[128];
+    if (get_name(name, dirent) == 0) {
+        snprintf(dirPath + len, sizeof(dirPath) - len, "%s/", name);
+    }
+    return len;
 }
 
 // from dos_ls.c, modified by Sam Daulton
-void follow_dir(uint16_t cluster, int indent,
-    uint8_t *image_buf, struct bpb33* bpb, struct node *references[], int numDataClusters)
+void follow_dir(uint32_t cluster, int indent,
+    struct dosimage *img, struct reftable *references, int maxCluster)
 {
 	int thisDirint = dirint; // the directory number for this directory
-    while (is_valid_cluster_correct(cluster, bpb))
+    // a directory whose chain loops is only read once round
+    uint32_t left = fatgraph_length(graph, cluster);
+    while (is_valid_cluster(img, cluster) && left-- > 0)
     {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-        
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
+        int numDirEntries = get_geometry(img)->clust_size / sizeof(struct direntry);
+        int changed = dir_changed(cluster);
         int i = 0;
         for ( ; i < numDirEntries; i++)
         {
-            // for each file in this directory
-            uint16_t followclust = print_dirent(dirent, indent, thisDirint);
-            if (is_file(dirent, indent)) {
+            // for each file in this directory; with a checkpoint, only
+            // what has changed is listed and checked
+            struct direntry *dirent = get_dirent(img, cluster, i);
+            struct direntry before = *dirent;
+            int unchanged = !changed && (!is_file(dirent, indent)
+                || claim_clean_entry(img, references, dirent, thisDirint, cluster, i));
+            uint32_t followclust = print_dirent(dirent, indent, thisDirint, unchanged, img);
+            if (!unchanged && is_file(dirent, indent)) {
                 // check size and fix inconsistency if necessary
-                check_size(dirent, image_buf, bpb, references, numDataClusters, thisDirint);
+                check_size(dirent, img, references, maxCluster, thisDirint, cluster, i);
+            }
+            if (memcmp(&before, dirent, sizeof(before)) != 0) {
+                plan_dirent(plan, cluster, i, &before, dirent);
             }
             if (followclust) {
                 // dirent is for a directory
-                follow_dir(followclust, indent+1, image_buf, bpb, references, numDataClusters);
+                size_t len = enter_dir(dirent);
+                follow_dir(followclust, indent+1, img, references, maxCluster);
+                dirPath[len] = '\0';
             }
-            dirent++;
         }
         
-        cluster = get_fat_entry(cluster, image_buf, bpb);
+        cluster = get_fat_entry(img, cluster);
     }
 }
 
 //from dos_ls.c modified by Sam Daulton
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb, struct node *references[], int numDataClusters)
+void traverse_root(struct dosimage *img, struct reftable *references, int maxCluster)
 {
-    uint16_t cluster = 0;
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    const struct dosgeom *geom = get_geometry(img);
+    if (geom->fattype == 32) {
+        // FAT-32 has no fixed root directory, just a cluster chain,
+        // which no directory entry owns
+        uint32_t cluster = geom->root_cluster;
+        uint32_t left = fatgraph_length(graph, cluster);
+        while (is_valid_cluster(img, cluster) && left-- > 0) {
+            ref_set_inDir(references, cluster, 1);
+            references->type[cluster] = get_cluster_type(cluster, img);
+            cluster = get_fat_entry(img, cluster);
+        }
+        follow_dir(geom->root_cluster, 0, img, references, maxCluster);
+        return;
+    }
+
+    uint32_t cluster = 0;
+    int changed = dir_changed(cluster);
     
     int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    for ( ; i < geom->root_ents; i++)
     {
-        uint16_t followclust = print_dirent(dirent, 0, 0);
-        if (is_file(dirent, 0)) {
-            check_size(dirent, image_buf, bpb, references, numDataClusters, 0);
+        struct direntry *dirent = get_dirent(img, cluster, i);
+        struct direntry before = *dirent;
+        int unchanged = !changed && (!is_file(dirent, 0)
+            || claim_clean_entry(img, references, dirent, 0, cluster, i));
+        uint32_t followclust = print_dirent(dirent, 0, 0, unchanged, img);
+        if (!unchanged && is_file(dirent, 0)) {
+            check_size(dirent, img, references, maxCluster, 0, cluster, i);
         }
-        if (is_valid_cluster_correct(followclust, bpb)) {            
-            follow_dir(followclust, 1, image_buf, bpb, references, numDataClusters);
+        if (memcmp(&before, dirent, sizeof(before)) != 0) {
+            plan_dirent(plan, cluster, i, &before, dirent);
+        }
+        if (is_valid_cluster(img, followclust)) {            
+            size_t len = enter_dir(dirent);
+            follow_dir(followclust, 1, img, references, maxCluster);
+            dirPath[len] = '\0';
         }
-        dirent++;
     }
 }
 
-// Written by Sam Daulton and Bria Vicenti
-int main(int argc, char** argv) {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
-    if (argc < 2) {
-	usage(argv[0]);
-    }
+// checks the image, adding the fixes it needs to the plan.  With a
+// checkpoint, what the scan found is hashed for the next one, and only
+// what has changed since the last clean check is looked at.
+void check_image(struct dosimage *img, int useCheckpoint) {
+    freem = freemap_load(img);
+    graph = fatgraph_build(img);
+    // one past the last data cluster, from the boot sector
+    int maxCluster = get_geometry(img)->max_cluster;
+
+    // initialize data structure to store information about each cluster,
+    // indexed by cluster number (so entries 0 and 1 go unused)
+    struct reftable *references = refs_alloc(maxCluster);
+    names = nameset_alloc();
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    int numDataClusters = bpb->bpbSectors - 1 - 9 - 9 - 14;
+    // read every directory on all cores first
+    scan = dirscan_run(img, scanThreads);
 
-    // initialize data structure to store information about each cluster
-    struct node *references[numDataClusters]; // only + 2 to create idempotent mapping from cluster number to index
-    for (int i = 2; i < numDataClusters; i ++) {
-        references[i] = malloc(sizeof(struct node));
-        node_init(references[i]);
+    if (useCheckpoint) {
+        thisCheck = checkpoint_take(img, scan);
+    }
+    if (lastClean) {
+        dirtyFat = calloc((get_geometry(img)->max_cluster + 63) / 64, sizeof(uint64_t));
+        uint32_t changed = checkpoint_fat_changes(lastClean, thisCheck, img, dirtyFat);
+        if (changed * CHECKPOINT_FULL_SHARE > lastClean->nfatsecs) {
+            log_printf(&out, LOG_FINDINGS, "%u of %u FAT sectors have changed since the last clean check, so everything is checked.\n",
+                   changed, lastClean->nfatsecs);
+            checkpoint_free(lastClean);
+            lastClean = NULL;
+        } else {
+            log_printf(&out, LOG_FINDINGS, "Checking what has changed since the last clean check.\n");
+        }
     }
 
     // traverse directory entries to gather metadata
-    traverse_root(image_buf, bpb, references, numDataClusters);
+    traverse_root(img, references, maxCluster);
     
     // find and fix orphans    
-    orphan_fixer(image_buf, bpb, references, numDataClusters);
+    orphan_fixer(img, references, maxCluster);
+
+    dirscan_free(scan);
+    fatgraph_free(graph);
+    freemap_free(freem);
+    refs_free(references);
+    nameset_free(names);
+    free(dirtyFat);
+}
 
-    unmmap_file(image_buf, &fd);
-    for (int i = 2; i < numDataClusters; i++) {        
-        free(references[i]);
+// reads the checkpoint left by the last clean check, if there is one
+// for this volume
+struct checkpoint *load_checkpoint(char *checkpointfile, struct dosimage *img) {
+    FILE *f = fopen(checkpointfile, "r");
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            perror(checkpointfile);
+        }
+        return NULL;
     }
+    struct checkpoint *cp = checkpoint_load(f);
+    fclose(f);
+    if (cp != NULL && !checkpoint_fits(cp, img)) {
+        fprintf(stderr, "%s: made for a different volume\n", checkpointfile);
+        checkpoint_free(cp);
+        cp = NULL;
+    }
+    return cp;
+}
 
-    free(bpb);
+// makes the fixes in a plan saved with -p
+int apply_saved_plan(char *planfile, char *imagename) {
+    FILE *f = fopen(planfile, "r");
+    if (f == NULL) {
+        perror(planfile);
+        return 1;
+    }
+    plan = plan_load(f);
+    fclose(f);
+    if (plan == NULL) {
+        return 1;
+    }
+
+    struct dosimage *img = open_image(imagename, IMAGE_RDWR);
+    if (img == NULL) {
+        return 1;
+    }
+    int applied = plan_apply(plan, img);
+    close_image(img);
+    plan_free(plan);
+    if (applied < 0) {
+        return 1;
+    }
+    printf("%d fixes made.\n", applied);
     return 0;
 }
+
+// checks one image, then makes the fixes it needs or saves them to
+// savePlan.  Returns 0, or 1 if the image couldn't be checked or fixed;
+// *fixes is set to the number of fixes made or saved.
+int scandisk(char *imagename, char *savePlan, char *checkpointFile, int *fixes) {
+    *fixes = 0;
+    imageName = imagename;
+
+    // the checks only read the image; what they would change goes into
+    // the plan, which is applied afterwards
+    struct dosimage *img = open_image(imagename, IMAGE_RDONLY);
+    if (img == NULL) {
+        return 1;
+    }
+    dirint = 0;
+    dirPath[0] = '\0';
+    plan = plan_new(img);
+    if (checkpointFile) {
+        lastClean = load_checkpoint(checkpointFile, img);
+    }
+    if (lastClean && checkpoint_unchanged(lastClean, img)) {
+        // neither the FAT nor any directory has changed, so the image is
+        // as clean as it was
+        log_printf(&out, LOG_FINDINGS, "Nothing has changed since the last clean check.\n");
+    } else {
+        check_image(img, checkpointFile != NULL);
+    }
+
+    // a clean check leaves a checkpoint for the next one
+    if (thisCheck && plan->nedits == 0) {
+        FILE *f = fopen(checkpointFile, "w");
+        if (f == NULL) {
+            perror(checkpointFile);
+        } else {
+            checkpoint_save(thisCheck, f);
+            if (fclose(f) != 0) {
+                perror(checkpointFile);
+            }
+        }
+    }
+    if (thisCheck) {
+        checkpoint_free(thisCheck);
+        thisCheck = NULL;
+    }
+    if (lastClean) {
+        checkpoint_free(lastClean);
+        lastClean = NULL;
+    }
+
+    int status = 0;
+    if (savePlan) {
+        FILE *f = fopen(savePlan, "w");
+        if (f == NULL) {
+            perror(savePlan);
+            status = 1;
+        } else {
+            plan_save(plan, img, f);
+            *fixes = plan->nedits;
+            if (fclose(f) != 0) {
+                perror(savePlan);
+                status = 1;
+            }
+        }
+        close_image(img);
+    } else if (checkOnly) {
+        // the image was only ever open read-only
+        close_image(img);
+    } else {
+        close_image(img);
+        // every fix goes in with one pass in image order and one sync
+        if (plan->nedits > 0) {
+            img = open_image(imagename, IMAGE_RDWR);
+            if (img == NULL) {
+                status = 1;
+            } else {
+                *fixes = plan_apply(plan, img);
+                close_image(img);
+                if (*fixes < 0) {
+                    *fixes = 0;
+                    status = 1;
+                }
+            }
+        }
+    }
+    plan_free(plan);
+    plan = NULL;
+
+    return status;
+}
+
+// one image in a batch, and how its check went
+struct batchjob {
+    char *imagename;
+    int status;
+    int issues;
+    int fixes;
+    double seconds;
+};
+
+struct batch {
+    struct batchjob *jobs;
+    int njobs;
+    int next;            // the next job to hand out
+    pthread_mutex_t lock; // held while an image's findings are written out
+};
+
+// with --check, each image's findings end with a record saying how the
+// check went
+void report_checked(FILE *f, struct batchjob *job) {
+    fprintf(f, "{\"image\":");
+    json_string(f, job->imagename);
+    fprintf(f, ",\"type\":\"checked\",\"status\":\"%s\",\"issues\":%d,\"seconds\":%.3f}\n",
+            job->status ? "failed" : job->issues ? "damaged" : "clean",
+            job->issues, job->seconds);
+}
+
+static double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// each batch thread takes the next image until there are none left.
+// An image is checked on one thread, so its directory scan gets just
+// that one, and its listing is thrown away; the summary says what
+// happened to it.  With --check, an image's findings are collected and
+// written out together, so records from different images don't mix.
+void *batch_worker(void *arg) {
+    struct batch *b = arg;
+    log_open(&out, -1, LOG_QUIET);
+    scanThreads = 1;
+    for (;;) {
+        int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->njobs) {
+            break;
+        }
+        struct batchjob *job = &b->jobs[i];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        issues = 0;
+        char *records = NULL;
+        size_t size = 0;
+        if (checkOnly) {
+            findings = open_memstream(&records, &size);
+        }
+        job->status = scandisk(job->imagename, NULL, NULL, &job->fixes);
+        job->issues = issues;
+        job->seconds = seconds_since(&start);
+        if (checkOnly) {
+            report_checked(findings, job);
+            fclose(findings);
+            findings = NULL;
+            pthread_mutex_lock(&b->lock);
+            fwrite(records, 1, size, stdout);
+            pthread_mutex_unlock(&b->lock);
+            free(records);
+        }
+    }
+    log_close(&out);
+    return NULL;
+}
+
+// adds the image names in listfile, one per line, to the batch
+int read_image_list(char *listfile, char ***images, int *nimages) {
+    FILE *f = fopen(listfile, "r");
+    if (f == NULL) {
+        perror(listfile);
+        return 1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        *images = realloc(*images, (*nimages + 1) * sizeof(char *));
+        (*images)[(*nimages)++] = strdup(line);
+    }
+    fclose(f);
+    return 0;
+}
+
+// checks and fixes every image on nthreads threads, then prints one
+// tab-separated line per image, in the order given, and a total; with
+// --check the findings are printed instead, as each image is done.
+// Returns 1 if any image couldn't be checked or fixed.
+int run_batch(char **images, int nimages, int nthreads) {
+    struct batch b;
+    b.jobs = calloc(nimages, sizeof(struct batchjob));
+    b.njobs = nimages;
+    b.next = 0;
+    pthread_mutex_init(&b.lock, NULL);
+    for (int i = 0; i < nimages; i++) {
+        b.jobs[i].imagename = images[i];
+    }
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > nimages) {
+        nthreads = nimages;
+    }
+    if (nthreads <= 0) {
+        nthreads = 1;
+    }
+
+    // pick the FAT-12 codec before the threads race to
+    fat12_best_codec();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (int t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, batch_worker, &b) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&b.lock);
+
+    int failed = 0, totalIssues = 0, totalFixes = 0;
+    if (checkOnly) {
+        for (int i = 0; i < nimages; i++) {
+            failed += b.jobs[i].status != 0;
+        }
+        free(b.jobs);
+        return failed ? 1 : 0;
+    }
+    printf("image\tstatus\tissues\tfixes\tseconds\n");
+    for (int i = 0; i < nimages; i++) {
+        struct batchjob *job = &b.jobs[i];
+        printf("%s\t%s\t%d\t%d\t%.3f\n", job->imagename,
+               job->status ? "failed" : job->issues ? "fixed" : "clean",
+               job->issues, job->fixes, job->seconds);
+        failed += job->status != 0;
+        totalIssues += job->issues;
+        totalFixes += job->fixes;
+    }
+    printf("total\t%d of %d failed\t%d\t%d\t%.3f\n", failed, nimages,
+           totalIssues, totalFixes, seconds_since(&start));
+    free(b.jobs);
+    return failed ? 1 : 0;
+}
+
+// Written by Sam Daulton and Bria Vicenti
+int main(int argc, char** argv) {
+    char *savePlan = NULL;
+    char *applyPlan = NULL;
+    char *checkpointFile = NULL;
+    char *listFile = NULL;
+    int batchThreads = -1;
+    static struct option longopts[] = {
+        { "check", no_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:p:a:j:l:qv", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            checkOnly = 1;
+            break;
+        case 'q':
+            logLevel = LOG_QUIET;
+            break;
+        case 'v':
+            logLevel = LOG_TREE;
+            break;
+        case 'c':
+            checkpointFile = optarg;
+            break;
+        case 'p':
+            savePlan = optarg;
+            break;
+        case 'a':
+            applyPlan = optarg;
+            break;
+        case 'j':
+            batchThreads = atoi(optarg);
+            break;
+        case 'l':
+            listFile = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (checkOnly) {
+        // the findings are the output; the listing is thrown away
+        if (applyPlan) {
+            usage(argv[0]);
+        }
+        setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    }
+
+    if (batchThreads >= 0 || listFile) {
+        if (savePlan || applyPlan || checkpointFile) {
+            usage(argv[0]);
+        }
+        char **images = NULL;
+        int nimages = 0;
+        if (listFile && read_image_list(listFile, &images, &nimages) != 0) {
+            return 1;
+        }
+        for (int i = optind; i < argc; i++) {
+            images = realloc(images, (nimages + 1) * sizeof(char *));
+            images[nimages++] = strdup(argv[i]);
+        }
+        if (nimages == 0) {
+            usage(argv[0]);
+        }
+        int status = run_batch(images, nimages, batchThreads);
+        for (int i = 0; i < nimages; i++) {
+            free(images[i]);
+        }
+        free(images);
+        return status;
+    }
+
+    if (optind != argc - 1 || (savePlan && applyPlan) || (checkpointFile && applyPlan)) {
+	usage(argv[0]);
+    }
+    char *imagename = argv[optind];
+    if (applyPlan) {
+        return apply_saved_plan(applyPlan, imagename);
+    }
+
+    // SCANDISK_THREADS sets how many threads read the directories, the
+    // default being one per CPU
+    char *threads = getenv("SCANDISK_THREADS");
+    scanThreads = threads ? atoi(threads) : 0;
+    if (!checkOnly) {
+        int fixes;
+        log_open(&out, STDOUT_FILENO, logLevel);
+        int status = scandisk(imagename, savePlan, checkpointFile, &fixes);
+        log_close(&out);
+        return status;
+    }
+    struct batchjob job = { imagename };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    findings = stdout;
+    log_open(&out, -1, LOG_QUIET);
+    job.status = scandisk(imagename, savePlan, checkpointFile, &job.fixes);
+    job.issues = issues;
+    job.seconds = seconds_since(&start);
+    report_checked(stdout, &job);
+    log_close(&out);
+    return job.status;
+}